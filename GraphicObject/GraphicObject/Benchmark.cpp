@@ -0,0 +1,408 @@
+﻿#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "DrawOrder.h"
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "SceneFiles.h"
+#include "TaskScheduler.h"
+#include "TiledRasterizer.h"
+
+using namespace std;
+
+// Benchmarks over synthetic scenes: construction, bulk edits through an
+// Aggregate, text and binary save/load, vertex generation and CPU rasterization.
+// Every result is one line of JSON (or CSV with --format csv) so runs can be
+// diffed and tracked over time. With --threads every benchmark is repeated per
+// pool size and reports its speedup over the first size given.
+// Build with the CMakeLists.txt next to the solution.
+
+struct BenchmarkOptions {
+    vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+    vector<string> scenes = { "flat", "deep" };
+    // Sizes of the shared TaskScheduler; empty keeps the default (all cores).
+    vector<unsigned> threads;
+    vector<string> only;
+    unsigned repeat = 3;
+    string format = "json";
+    string output;
+    string directory = filesystem::temp_directory_path().string();
+};
+
+// One measured operation over a scene of a given size.
+struct BenchmarkResult {
+    string name;
+    string scene;
+    size_t shapes;
+    unsigned threads;
+    vector<double> seconds;
+    double bytes;
+};
+
+class BenchmarkReport {
+private:
+    ostream& out;
+    string format;
+    bool headerWritten;
+    // Median of the first run of every benchmark, scene and size, for the speedup column.
+    map<string, double> baselines;
+
+    static double median(vector<double> values) {
+        sort(values.begin(), values.end());
+        size_t middle = values.size() / 2;
+        return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2.0;
+    }
+
+public:
+    BenchmarkReport(ostream& out, const string& format) : out(out), format(format), headerWritten(false) {}
+
+    void write(const BenchmarkResult& result) {
+        double best = *min_element(result.seconds.begin(), result.seconds.end());
+        double middle = median(result.seconds);
+        double shapesPerSecond = middle > 0.0 ? result.shapes / middle : 0.0;
+        double megabytesPerSecond = middle > 0.0 ? result.bytes / (1024.0 * 1024.0) / middle : 0.0;
+        string key = result.name + "/" + result.scene + "/" + to_string(result.shapes);
+        double baseline = baselines.emplace(key, middle).first->second;
+        double speedup = middle > 0.0 ? baseline / middle : 1.0;
+        if (format == "csv") {
+            if (!headerWritten)
+                out << "benchmark,scene,shapes,threads,runs,min_s,median_s,shapes_per_s,bytes,mb_per_s,speedup" << endl;
+            out << result.name << "," << result.scene << "," << result.shapes << "," << result.threads << "," << result.seconds.size() << ","
+                << best << "," << middle << "," << shapesPerSecond << "," << result.bytes << "," << megabytesPerSecond << ","
+                << speedup << endl;
+        }
+        else {
+            out << "{\"benchmark\":\"" << result.name << "\",\"scene\":\"" << result.scene << "\",\"shapes\":" << result.shapes
+                << ",\"threads\":" << result.threads << ",\"runs\":" << result.seconds.size() << ",\"min_s\":" << best << ",\"median_s\":" << middle
+                << ",\"shapes_per_s\":" << shapesPerSecond << ",\"bytes\":" << result.bytes
+                << ",\"mb_per_s\":" << megabytesPerSecond << ",\"speedup\":" << speedup << "}" << endl;
+        }
+        headerWritten = true;
+    }
+};
+
+// Builds reproducible scenes: a mix of circles, rectangles and triangles with
+// random positions, sizes and colors inside a 1920x1080 frame.
+class SceneGenerator {
+private:
+    mt19937 random;
+    uniform_real_distribution<float> position;
+    uniform_real_distribution<float> size;
+
+    GraphicObject* createShape(Scene& scene) {
+        float x = position(random) * 1920.f;
+        float y = position(random) * 1080.f;
+        float extent = 1.f + size(random);
+        sf::Uint32 color = static_cast<sf::Uint32>(random());
+        switch (random() % 3) {
+        case 0: {
+            Circle* circle = scene.create<Circle>();
+            circle->set(x, y, extent, color);
+            return circle;
+        }
+        case 1: {
+            Rectangle* rectangle = scene.create<Rectangle>();
+            rectangle->set(x, y, extent, extent * 1.5f, color);
+            return rectangle;
+        }
+        default: {
+            Triangle* triangle = scene.create<Triangle>();
+            sf::Vector2f points[3] = { sf::Vector2f(0.f, extent), sf::Vector2f(extent / 2.f, 0.f), sf::Vector2f(extent, extent) };
+            triangle->set(x, y, points, color);
+            return triangle;
+        }
+        }
+    }
+
+    // Splits count leaves over `fanout` subtrees until single shapes remain.
+    GraphicObject* createTree(Scene& scene, size_t count, size_t fanout) {
+        if (count == 1)
+            return createShape(scene);
+        Aggregate* aggregate = scene.create<Aggregate>();
+        size_t children = min(fanout, count);
+        for (size_t k = 0; k < children; k++) {
+            size_t part = count * (k + 1) / children - count * k / children;
+            aggregate->addObject(createTree(scene, part, fanout));
+        }
+        return aggregate;
+    }
+
+public:
+    SceneGenerator() : random(12345), position(0.f, 1.f), size(0.f, 19.f) {}
+
+    // "flat": one Aggregate holding every shape; "deep": a 4-ary Aggregate tree.
+    // Either way the scene has a single top-level object.
+    void generate(Scene& scene, const string& kind, size_t shapes) {
+        random.seed(12345);
+        if (kind == "flat") {
+            Aggregate* root = scene.create<Aggregate>();
+            for (size_t i = 0; i < shapes; i++)
+                root->addObject(createShape(scene));
+            scene.objects.push_back(root);
+        }
+        else {
+            scene.objects.push_back(createTree(scene, shapes, 4));
+        }
+    }
+};
+
+class BenchmarkRunner {
+private:
+    const BenchmarkOptions& options;
+    BenchmarkReport& report;
+    SceneGenerator generator;
+
+    bool selected(const string& name) const {
+        return options.only.empty() || find(options.only.begin(), options.only.end(), name) != options.only.end();
+    }
+
+    template <typename Operation>
+    static double measure(Operation operation) {
+        auto start = chrono::steady_clock::now();
+        operation();
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Runs operation options.repeat times; setup runs before each and is not timed.
+    void run(const string& name, const string& kind, size_t shapes, function<void()> operation,
+             function<void()> setup = nullptr, function<double()> bytes = nullptr) {
+        if (!selected(name))
+            return;
+        BenchmarkResult result = { name, kind, shapes, TaskScheduler::shared().getThreadCount(), {}, 0.0 };
+        for (unsigned run = 0; run < options.repeat; run++) {
+            if (setup)
+                setup();
+            result.seconds.push_back(measure(operation));
+        }
+        if (bytes)
+            result.bytes = bytes();
+        report.write(result);
+    }
+
+    static double fileSize(const string& filename) {
+        error_code error;
+        auto size = filesystem::file_size(filename, error);
+        return error ? 0.0 : static_cast<double>(size);
+    }
+
+public:
+    BenchmarkRunner(const BenchmarkOptions& options, BenchmarkReport& report) : options(options), report(report) {}
+
+    void runScene(const string& kind, size_t shapes) {
+        unique_ptr<Scene> built;
+        run("construct", kind, shapes, [&] {
+            generator.generate(*built, kind, shapes);
+        }, [&] { built.reset(new Scene()); });
+        built.reset();
+
+        Scene scene;
+        generator.generate(scene, kind, shapes);
+        GraphicObject* root = scene.objects.front();
+        float direction = 1.f;
+
+        run("move", kind, shapes, [&] {
+            root->move(direction, -direction);
+            direction = -direction;
+        });
+        run("change_color", kind, shapes, [&] {
+            root->changeColor(sf::Color(static_cast<sf::Uint8>(direction > 0.f ? 200 : 100), 80, 40, 180));
+            direction = -direction;
+        });
+        run("change_size", kind, shapes, [&] {
+            root->changeSize(direction > 0.f ? 1.25f : 0.8f);
+            direction = -direction;
+        });
+        run("set_visible", kind, shapes, [&] {
+            root->setVisible(direction < 0.f);
+            direction = -direction;
+        });
+        root->setVisible(true);
+
+        string base = (filesystem::path(options.directory) / ("graphicobject_bench_" + kind + "_" + to_string(shapes))).string();
+        string textFile = base + ".txt";
+        string binaryFile = base + binarySceneExtension;
+        string compressedFile = base + compressedSceneExtension;
+        string roundedFile = base + "_rounded" + compressedSceneExtension;
+        bool saved = true;
+        run("save_text", kind, shapes, [&] {
+            saved = saveTextScene(textFile, scene) && saved;
+        }, nullptr, [&] { return fileSize(textFile); });
+        run("save_binary", kind, shapes, [&] {
+            saved = saveBinaryScene(binaryFile, scene) && saved;
+        }, nullptr, [&] { return fileSize(binaryFile); });
+        // save_compressed_rounded rounds coordinates to 1/16 pixel.
+        run("save_compressed", kind, shapes, [&] {
+            saved = saveCompressedScene(compressedFile, scene) && saved;
+        }, nullptr, [&] { return fileSize(compressedFile); });
+        run("save_compressed_rounded", kind, shapes, [&] {
+            saved = saveCompressedScene(roundedFile, scene, 1.f / 16.f, true) && saved;
+        }, nullptr, [&] { return fileSize(roundedFile); });
+        if (!saved)
+            cerr << "Cannot write scenes to " << options.directory << endl;
+
+        unique_ptr<Scene> loaded;
+        bool complete = true;
+        run("load_text", kind, shapes, [&] {
+            complete = loadTextScene(textFile, *loaded) && complete;
+        }, [&] { loaded.reset(new Scene()); }, [&] { return fileSize(textFile); });
+        run("load_binary", kind, shapes, [&] {
+            complete = loadBinaryScene(binaryFile, *loaded) && complete;
+        }, [&] { loaded.reset(new Scene()); }, [&] { return fileSize(binaryFile); });
+        run("load_compressed", kind, shapes, [&] {
+            complete = loadCompressedScene(compressedFile, *loaded) && complete;
+        }, [&] { loaded.reset(new Scene()); }, [&] { return fileSize(compressedFile); });
+        if (!complete)
+            cerr << "Cannot load the saved " << kind << " scene" << endl;
+        loaded.reset();
+        remove(textFile.c_str());
+        remove(binaryFile.c_str());
+        remove(compressedFile.c_str());
+        remove(roundedFile.c_str());
+
+        // "bytes" is the size of the generated vertex list; vertices_lod
+        // tessellates circles for a 1:1 view of the 1920x1080 frame.
+        DrawOrder order;
+        vector<sf::Vertex> vertices;
+        auto vertexBytes = [&] { return static_cast<double>(vertices.size() * sizeof(sf::Vertex)); };
+        run("vertices", kind, shapes, [&] {
+            order.update(scene.store, scene.objects);
+            vertices.clear();
+            for (auto handle : order.getHandles())
+                scene.store.appendVertices(scene.store.indexOf(handle), vertices);
+        }, [&] { order.invalidate(); }, vertexBytes);
+        run("vertices_lod", kind, shapes, [&] {
+            order.update(scene.store, scene.objects);
+            vertices.clear();
+            for (auto handle : order.getHandles())
+                scene.store.appendVertices(scene.store.indexOf(handle), vertices, 1.f);
+        }, [&] { order.invalidate(); }, vertexBytes);
+
+        TiledRasterizer rasterizer(1920, 1080);
+        run("rasterize", kind, shapes, [&] {
+            rasterizer.clear(sf::Color::Black);
+            rasterizer.drawShapes(scene.store, order.getHandles());
+            rasterizer.display();
+        });
+    }
+
+    void runAll() {
+        vector<unsigned> threads = options.threads;
+        if (threads.empty())
+            threads.push_back(TaskScheduler::shared().getThreadCount());
+        for (auto count : threads) {
+            TaskScheduler::shared().setThreadCount(count);
+            for (auto shapes : options.sizes)
+                for (auto& kind : options.scenes)
+                    runScene(kind, shapes);
+        }
+    }
+};
+
+static vector<string> splitList(const string& list) {
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while (getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+static void printUsage() {
+    cout << "Usage: GraphicObjectBench [options]" << endl;
+    cout << "  --sizes 1000,10000,...   shape counts (default 1000 to 1000000; 10000000 needs several GB)" << endl;
+    cout << "  --scenes flat,deep       scene kinds" << endl;
+    cout << "  --threads 1,2,4,...      repeat everything with these thread pool sizes (default: all cores)" << endl;
+    cout << "  --only move,load_text    run only these benchmarks: construct, move, change_color, change_size," << endl;
+    cout << "                           set_visible, save_text, save_binary, save_compressed," << endl;
+    cout << "                           save_compressed_rounded, load_text, load_binary, load_compressed," << endl;
+    cout << "                           vertices, vertices_lod, rasterize" << endl;
+    cout << "  --repeat N               runs per benchmark (default 3)" << endl;
+    cout << "  --format json|csv        output format (default json, one object per line)" << endl;
+    cout << "  --output FILE            write results to FILE instead of stdout" << endl;
+    cout << "  --dir DIR                directory for temporary scene files" << endl;
+}
+
+static int badValue(const string& option, const string& value) {
+    cerr << "Bad value for " << option << ": '" << value << "'" << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i];
+        if (argument == "--help" || argument == "-h") {
+            printUsage();
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << argument << endl;
+            return 1;
+        }
+        string value = argv[++i];
+        if (argument == "--sizes") {
+            options.sizes.clear();
+            for (auto& item : splitList(value)) {
+                size_t size;
+                if (!parseNumber(item, size))
+                    return badValue(argument, value);
+                options.sizes.push_back(size);
+            }
+        }
+        else if (argument == "--scenes")
+            options.scenes = splitList(value);
+        else if (argument == "--threads") {
+            options.threads.clear();
+            for (auto& item : splitList(value)) {
+                unsigned threads;
+                if (!parseNumber(item, threads))
+                    return badValue(argument, value);
+                options.threads.push_back(max(1u, threads));
+            }
+        }
+        else if (argument == "--only")
+            options.only = splitList(value);
+        else if (argument == "--repeat") {
+            unsigned repeat;
+            if (!parseNumber(value, repeat))
+                return badValue(argument, value);
+            options.repeat = max(1u, repeat);
+        }
+        else if (argument == "--format")
+            options.format = value;
+        else if (argument == "--output")
+            options.output = value;
+        else if (argument == "--dir")
+            options.directory = value;
+        else {
+            cerr << "Unknown option " << argument << endl;
+            printUsage();
+            return 1;
+        }
+    }
+
+    ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file.is_open()) {
+            cerr << "Cannot write " << options.output << endl;
+            return 1;
+        }
+    }
+    BenchmarkReport report(options.output.empty() ? cout : file, options.format);
+    BenchmarkRunner runner(options, report);
+    runner.runAll();
+    return 0;
+}
@@ -0,0 +1,392 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "FileProgress.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Binary scene file, version 1 (little-endian).
+//
+//   BinarySceneHeader
+//   CircleRecord[circleCount]
+//   RectangleRecord[rectangleCount]
+//   TriangleRecord[triangleCount]
+//   AggregateRecord[aggregateCount]
+//   uint32_t children[childCount]
+//
+// Every section starts at the offset stored in the header (8-byte aligned).
+// A node reference packs the record type into the top two bits and the record
+// index into the rest. An Aggregate owns the range [firstChild, firstChild +
+// childCount) of the children table; the top-level objects are the range
+// [rootFirst, rootFirst + rootCount). Children are always written before their
+// parent, so a reader can build the tree bottom-up in one pass.
+
+const char binarySceneMagic[4] = { 'G', 'O', 'B', 'S' };
+const uint32_t binarySceneVersion = 1;
+
+enum BinaryNodeType : uint32_t {
+    BinaryCircle = 0,
+    BinaryRectangle = 1,
+    BinaryTriangle = 2,
+    BinaryAggregate = 3
+};
+
+inline uint32_t makeNodeRef(BinaryNodeType type, uint32_t index) {
+    return (static_cast<uint32_t>(type) << 30) | index;
+}
+
+inline BinaryNodeType nodeRefType(uint32_t ref) {
+    return static_cast<BinaryNodeType>(ref >> 30);
+}
+
+inline uint32_t nodeRefIndex(uint32_t ref) {
+    return ref & 0x3FFFFFFFu;
+}
+
+struct BinarySceneHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t circleCount;
+    uint32_t rectangleCount;
+    uint32_t triangleCount;
+    uint32_t aggregateCount;
+    uint32_t childCount;
+    uint32_t rootFirst;
+    uint32_t rootCount;
+    uint32_t reserved;
+    uint64_t circleOffset;
+    uint64_t rectangleOffset;
+    uint64_t triangleOffset;
+    uint64_t aggregateOffset;
+    uint64_t childOffset;
+};
+
+// Shape records are the shape's values (see ShapeFormat) followed by its color.
+
+struct CircleRecord {
+    static constexpr BinaryNodeType node = BinaryCircle;
+    float x, y;
+    float radius;
+    uint32_t color;
+};
+
+struct RectangleRecord {
+    static constexpr BinaryNodeType node = BinaryRectangle;
+    float x, y;
+    float width, height;
+    uint32_t color;
+};
+
+struct TriangleRecord {
+    static constexpr BinaryNodeType node = BinaryTriangle;
+    float x, y;
+    float points[6];
+    uint32_t color;
+};
+
+struct AggregateRecord {
+    uint32_t firstChild;
+    uint32_t childCount;
+};
+
+static_assert(sizeof(BinarySceneHeader) == 80, "BinarySceneHeader layout");
+static_assert(sizeof(CircleRecord) == 16, "CircleRecord layout");
+static_assert(sizeof(RectangleRecord) == 20, "RectangleRecord layout");
+static_assert(sizeof(TriangleRecord) == 36, "TriangleRecord layout");
+static_assert(sizeof(AggregateRecord) == 8, "AggregateRecord layout");
+
+// Collects records in memory during a single walk of the scene and writes each
+// section with a few large stream writes. The records hold world geometry and no
+// pointers into the scene, so they also serve as a snapshot that can be
+// written out on another thread, in either format, while the scene changes.
+class BinarySceneWriter {
+private:
+    tuple<vector<CircleRecord>, vector<RectangleRecord>, vector<TriangleRecord>> shapes;
+    vector<AggregateRecord> aggregates;
+    vector<uint32_t> children;
+
+    static uint64_t align(uint64_t offset) {
+        return (offset + 7) & ~uint64_t(7);
+    }
+
+    // Sections are written this many bytes at a time, so that progress moves
+    // and a cancellation is noticed while a large one is written.
+    static constexpr size_t writeChunk = 1 << 20;
+
+    // False when cancelled.
+    template <typename T>
+    static bool writeSection(ofstream& file, uint64_t& position, uint64_t offset, const vector<T>& records,
+                             FileProgress* progress) {
+        static const char padding[8] = {};
+        file.write(padding, static_cast<streamsize>(offset - position));
+        const char* bytes = reinterpret_cast<const char*>(records.data());
+        size_t size = records.size() * sizeof(T);
+        for (size_t written = 0; written < size; written += writeChunk) {
+            file.write(bytes + written, static_cast<streamsize>(min(writeChunk, size - written)));
+            if (progress) {
+                progress->done = static_cast<size_t>(offset + min(size, written + writeChunk));
+                if (progress->cancelled)
+                    return false;
+            }
+        }
+        position = offset + size;
+        return true;
+    }
+
+public:
+    template <typename Record>
+    uint32_t add(const Record& record) {
+        vector<Record>& records = get<vector<Record>>(shapes);
+        records.push_back(record);
+        return makeNodeRef(Record::node, static_cast<uint32_t>(records.size() - 1));
+    }
+
+    uint32_t addAggregate(const vector<uint32_t>& childRefs) {
+        AggregateRecord record;
+        record.firstChild = static_cast<uint32_t>(children.size());
+        record.childCount = static_cast<uint32_t>(childRefs.size());
+        children.insert(children.end(), childRefs.begin(), childRefs.end());
+        aggregates.push_back(record);
+        return makeNodeRef(BinaryAggregate, static_cast<uint32_t>(aggregates.size() - 1));
+    }
+
+    template <typename Record>
+    const vector<Record>& getRecords() const {
+        return get<vector<Record>>(shapes);
+    }
+
+    const vector<AggregateRecord>& getAggregates() const {
+        return aggregates;
+    }
+
+    const vector<uint32_t>& getChildren() const {
+        return children;
+    }
+
+    // progress counts bytes; false when cancelled through it.
+    bool write(const string& filename, const vector<uint32_t>& roots, FileProgress* progress = nullptr) {
+        const vector<CircleRecord>& circles = getRecords<CircleRecord>();
+        const vector<RectangleRecord>& rectangles = getRecords<RectangleRecord>();
+        const vector<TriangleRecord>& triangles = getRecords<TriangleRecord>();
+        BinarySceneHeader header = {};
+        memcpy(header.magic, binarySceneMagic, sizeof(header.magic));
+        header.version = binarySceneVersion;
+        header.circleCount = static_cast<uint32_t>(circles.size());
+        header.rectangleCount = static_cast<uint32_t>(rectangles.size());
+        header.triangleCount = static_cast<uint32_t>(triangles.size());
+        header.aggregateCount = static_cast<uint32_t>(aggregates.size());
+        header.rootFirst = static_cast<uint32_t>(children.size());
+        header.rootCount = static_cast<uint32_t>(roots.size());
+        header.childCount = static_cast<uint32_t>(children.size() + roots.size());
+
+        header.circleOffset = align(sizeof(BinarySceneHeader));
+        header.rectangleOffset = align(header.circleOffset + circles.size() * sizeof(CircleRecord));
+        header.triangleOffset = align(header.rectangleOffset + rectangles.size() * sizeof(RectangleRecord));
+        header.aggregateOffset = align(header.triangleOffset + triangles.size() * sizeof(TriangleRecord));
+        header.childOffset = align(header.aggregateOffset + aggregates.size() * sizeof(AggregateRecord));
+
+        ofstream file(filename, ios::binary);
+        if (!file.is_open())
+            return false;
+        children.insert(children.end(), roots.begin(), roots.end());
+
+        if (progress)
+            progress->total = static_cast<size_t>(header.childOffset + children.size() * sizeof(uint32_t));
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        uint64_t position = sizeof(header);
+        bool whole = writeSection(file, position, header.circleOffset, circles, progress) &&
+            writeSection(file, position, header.rectangleOffset, rectangles, progress) &&
+            writeSection(file, position, header.triangleOffset, triangles, progress) &&
+            writeSection(file, position, header.aggregateOffset, aggregates, progress) &&
+            writeSection(file, position, header.childOffset, children, progress);
+        children.resize(header.rootFirst);
+        file.flush();
+        return whole && file.good();
+    }
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+public:
+    MappedFile() : data(nullptr), length(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& filename) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(info.st_size);
+#endif
+        if (!data) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap(const_cast<char*>(data), length);
+#endif
+        data = nullptr;
+        length = 0;
+    }
+
+    const char* getData() const {
+        return data;
+    }
+
+    size_t getSize() const {
+        return length;
+    }
+};
+
+// Zero-copy view of a mapped binary scene: the record arrays point straight
+// into the mapping and stay valid while the MappedFile is open.
+class BinarySceneView {
+private:
+    const BinarySceneHeader* header;
+    const char* base;
+
+    static bool sectionFits(uint64_t offset, uint64_t count, uint64_t recordSize, size_t fileSize) {
+        return offset % 4 == 0 && offset <= fileSize && count <= (fileSize - offset) / recordSize;
+    }
+
+public:
+    BinarySceneView() : header(nullptr), base(nullptr) {}
+
+    bool open(const MappedFile& file) {
+        header = nullptr;
+        base = file.getData();
+        size_t size = file.getSize();
+        if (!base || size < sizeof(BinarySceneHeader))
+            return false;
+        const BinarySceneHeader* candidate = reinterpret_cast<const BinarySceneHeader*>(base);
+        if (memcmp(candidate->magic, binarySceneMagic, sizeof(candidate->magic)) != 0 || candidate->version != binarySceneVersion)
+            return false;
+        if (!sectionFits(candidate->circleOffset, candidate->circleCount, sizeof(CircleRecord), size) ||
+            !sectionFits(candidate->rectangleOffset, candidate->rectangleCount, sizeof(RectangleRecord), size) ||
+            !sectionFits(candidate->triangleOffset, candidate->triangleCount, sizeof(TriangleRecord), size) ||
+            !sectionFits(candidate->aggregateOffset, candidate->aggregateCount, sizeof(AggregateRecord), size) ||
+            !sectionFits(candidate->childOffset, candidate->childCount, sizeof(uint32_t), size))
+            return false;
+        if (uint64_t(candidate->rootFirst) + candidate->rootCount > candidate->childCount)
+            return false;
+        header = candidate;
+        return true;
+    }
+
+    const BinarySceneHeader& getHeader() const {
+        return *header;
+    }
+
+    // Records of one shape type, selected by Record::node.
+    template <typename Record>
+    const Record* records() const {
+        uint64_t offset = Record::node == BinaryCircle ? header->circleOffset :
+            Record::node == BinaryRectangle ? header->rectangleOffset : header->triangleOffset;
+        return reinterpret_cast<const Record*>(base + offset);
+    }
+
+    const AggregateRecord* aggregates() const {
+        return reinterpret_cast<const AggregateRecord*>(base + header->aggregateOffset);
+    }
+
+    const uint32_t* children() const {
+        return reinterpret_cast<const uint32_t*>(base + header->childOffset);
+    }
+
+    // Checks that a node reference points at an existing record.
+    bool isValidRef(uint32_t ref) const {
+        uint32_t index = nodeRefIndex(ref);
+        switch (nodeRefType(ref)) {
+        case BinaryCircle:
+            return index < header->circleCount;
+        case BinaryRectangle:
+            return index < header->rectangleCount;
+        case BinaryTriangle:
+            return index < header->triangleCount;
+        case BinaryAggregate:
+            return index < header->aggregateCount &&
+                uint64_t(aggregates()[index].firstChild) + aggregates()[index].childCount <= header->rootFirst;
+        }
+        return false;
+    }
+};
@@ -0,0 +1,505 @@
+﻿#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "BinaryScene.h"
+#include "ShapeFormat.h"
+
+using namespace std;
+
+// Compressed scene file, version 1, for archiving and transfer.
+//
+//   CompressedSceneHeader
+//   blocks: uint32_t rawSize, uint32_t storedSize, storedSize bytes
+//   a block with rawSize 0 ends the file
+//
+// The blocks hold one byte stream, compressed per block with a small LZ77
+// codec (stored as is when that does not pay, storedSize == rawSize). The
+// stream is the scene tree in the order of the text format:
+//
+//   varint rootCount, then each node as
+//   byte BinaryNodeType;
+//   Aggregate: varint childCount, then the children;
+//   shapes:    color, then the values of the ShapeFormat.
+//
+// A color is a varint palette code: 0 is followed by the color itself (four
+// bytes), which joins the palette, k > 0 repeats palette entry k - 1.
+// A value is a varint v: an even v is zigzag(q - previous q) << 1, q being
+// the value in multiples of the header's quantum and the previous q that of
+// the same value of the last shape of the type to use one; an odd v is
+// followed by the float itself. The writer uses q wherever it gives back the
+// value exactly, so files are lossless, unless it is asked to round to the
+// quantum, which trades precision for size.
+//
+// Writer and reader keep one block in memory, so neither ever holds the file.
+
+const char compressedSceneMagic[4] = { 'G', 'O', 'B', 'Z' };
+const uint32_t compressedSceneVersion = 1;
+
+struct CompressedSceneHeader {
+    char magic[4];
+    uint32_t version;
+    float quantum;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(CompressedSceneHeader) == 16, "CompressedSceneHeader layout");
+
+// LZ77 for one block, in the layout of LZ4 sequences: a token byte holding
+// the literal count and the match length - 4 (15 meaning more length bytes
+// follow), the literals, then a two-byte offset back into the output. The
+// last sequence of a block is literals only.
+class SceneBlockCodec {
+private:
+    static const size_t minimumMatch = 4;
+    static const size_t hashBits = 14;
+
+    vector<uint32_t> table;
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static size_t hash(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - hashBits);
+    }
+
+    static void writeLength(vector<unsigned char>& out, size_t length) {
+        for (; length >= 255; length -= 255)
+            out.push_back(255);
+        out.push_back(static_cast<unsigned char>(length));
+    }
+
+    static void writeSequence(vector<unsigned char>& out, const unsigned char* literals, size_t literalCount,
+                              size_t offset, size_t matchLength) {
+        size_t matchCode = matchLength ? matchLength - minimumMatch : 0;
+        out.push_back(static_cast<unsigned char>((min<size_t>(literalCount, 15) << 4) | min<size_t>(matchCode, 15)));
+        if (literalCount >= 15)
+            writeLength(out, literalCount - 15);
+        out.insert(out.end(), literals, literals + literalCount);
+        if (!matchLength)
+            return;
+        out.push_back(static_cast<unsigned char>(offset));
+        out.push_back(static_cast<unsigned char>(offset >> 8));
+        if (matchCode >= 15)
+            writeLength(out, matchCode - 15);
+    }
+
+    static bool readLength(const unsigned char*& in, const unsigned char* end, size_t& length) {
+        for (;;) {
+            if (in == end)
+                return false;
+            unsigned char byte = *in++;
+            length += byte;
+            if (byte != 255)
+                return true;
+        }
+    }
+
+public:
+    SceneBlockCodec() : table(size_t(1) << hashBits) {}
+
+    // Appends the compressed form of data to out.
+    void compress(const unsigned char* data, size_t size, vector<unsigned char>& out) {
+        fill(table.begin(), table.end(), 0);
+        size_t anchor = 0;
+        size_t position = 0;
+        size_t misses = 0;
+        // Matches start at least this far from the end, so the last bytes are literals.
+        size_t limit = size > 12 ? size - 12 : 0;
+        while (position < limit) {
+            uint32_t sequence = read32(data + position);
+            uint32_t& slot = table[hash(sequence)];
+            size_t candidate = slot;
+            slot = static_cast<uint32_t>(position + 1);
+            if (candidate && position + 1 - candidate <= 0xFFFF && read32(data + candidate - 1) == sequence) {
+                size_t match = candidate - 1;
+                size_t length = minimumMatch;
+                while (position + length < size && data[match + length] == data[position + length])
+                    length++;
+                writeSequence(out, data + anchor, position - anchor, position - match, length);
+                position += length;
+                anchor = position;
+                misses = 0;
+            }
+            else {
+                // Skip faster through data that does not compress.
+                position += 1 + (misses++ >> 6);
+            }
+        }
+        writeSequence(out, data + anchor, size - anchor, 0, 0);
+    }
+
+    // False when the data is not a valid block of exactly size bytes.
+    static bool decompress(const unsigned char* in, size_t inSize, unsigned char* out, size_t size) {
+        const unsigned char* end = in + inSize;
+        size_t produced = 0;
+        for (;;) {
+            if (in == end)
+                return false;
+            unsigned char token = *in++;
+            size_t literalCount = token >> 4;
+            if (literalCount == 15 && !readLength(in, end, literalCount))
+                return false;
+            if (literalCount > static_cast<size_t>(end - in) || literalCount > size - produced)
+                return false;
+            memcpy(out + produced, in, literalCount);
+            in += literalCount;
+            produced += literalCount;
+            if (in == end)
+                return produced == size;
+            if (end - in < 2)
+                return false;
+            size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+            size_t length = token & 15;
+            if (length == 15 && !readLength(in, end, length))
+                return false;
+            length += minimumMatch;
+            if (offset == 0 || offset > produced || length > size - produced)
+                return false;
+            unsigned char* target = out + produced;
+            const unsigned char* source = target - offset;
+            if (offset >= length)
+                memcpy(target, source, length);
+            else
+                for (size_t k = 0; k < length; k++)
+                    target[k] = source[k];
+            produced += length;
+        }
+    }
+};
+
+// The quantum files are written with unless rounding asks for another one:
+// fine enough for every position an editor makes (whole and half pixels,
+// multiples of ten), while values that are not on it stay exact floats.
+const float compressedSceneQuantum = 1.f / 256.f;
+
+inline uint64_t zigzagEncode(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline float dequantize(int64_t q, float quantum) {
+    return static_cast<float>(static_cast<double>(q) * quantum);
+}
+
+// Shared by writer and reader: the running state that values and colors are
+// coded against.
+struct CompressedSceneModel {
+    // Largest q stored, so deltas and their zigzag codes fit in 64 bits.
+    static constexpr double maximumQuantized = 4503599627370496.0;  // 2^52
+    static const size_t maximumPalette = 1 << 16;
+    static const size_t maximumValues = 8;
+
+    int64_t previous[4][maximumValues];
+    vector<uint32_t> palette;
+
+    CompressedSceneModel() {
+        memset(previous, 0, sizeof(previous));
+    }
+};
+
+static_assert(ShapeFormat<Triangle>::valueCount <= CompressedSceneModel::maximumValues, "too many shape values");
+
+class CompressedSceneWriter {
+private:
+    static const size_t blockSize = 1 << 18;
+
+    ofstream file;
+    vector<unsigned char> block;
+    vector<unsigned char> packed;
+    SceneBlockCodec codec;
+    CompressedSceneModel model;
+    unordered_map<uint32_t, uint32_t> paletteCodes;
+    float quantum;
+    bool rounding;
+
+    void flushBlock() {
+        if (block.empty())
+            return;
+        packed.clear();
+        codec.compress(block.data(), block.size(), packed);
+        bool store = packed.size() >= block.size();
+        uint32_t sizes[2] = { static_cast<uint32_t>(block.size()), static_cast<uint32_t>(store ? block.size() : packed.size()) };
+        file.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+        const vector<unsigned char>& data = store ? block : packed;
+        file.write(reinterpret_cast<const char*>(data.data()), sizes[1]);
+        block.clear();
+    }
+
+    void putByte(unsigned char byte) {
+        block.push_back(byte);
+    }
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            block.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        block.push_back(static_cast<unsigned char>(value));
+    }
+
+    void putRaw(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        block.insert(block.end(), bytes, bytes + size);
+    }
+
+    void endNode() {
+        if (block.size() >= blockSize)
+            flushBlock();
+    }
+
+    void putValue(BinaryNodeType node, size_t slot, float value) {
+        double scaled = static_cast<double>(value) / quantum;
+        if (isfinite(scaled) && fabs(scaled) < CompressedSceneModel::maximumQuantized) {
+            int64_t q = llround(scaled);
+            if (rounding || (dequantize(q, quantum) == value && !(value == 0.f && signbit(value)))) {
+                int64_t& previous = model.previous[node][slot];
+                putVarint(zigzagEncode(q - previous) << 1);
+                previous = q;
+                return;
+            }
+        }
+        putVarint(1);
+        putRaw(&value, sizeof(value));
+    }
+
+    void putColor(uint32_t color) {
+        auto found = paletteCodes.find(color);
+        if (found != paletteCodes.end()) {
+            putVarint(found->second + 1);
+            return;
+        }
+        putVarint(0);
+        putRaw(&color, sizeof(color));
+        if (model.palette.size() < CompressedSceneModel::maximumPalette) {
+            paletteCodes.emplace(color, static_cast<uint32_t>(model.palette.size()));
+            model.palette.push_back(color);
+        }
+    }
+
+public:
+    CompressedSceneWriter() : quantum(compressedSceneQuantum), rounding(false) {}
+
+    // With rounding every value is rounded to the quantum, losing what lies
+    // below it; otherwise the file gives back exactly the values written.
+    bool open(const string& filename, float quantum = compressedSceneQuantum, bool rounding = false) {
+        this->quantum = quantum;
+        this->rounding = rounding;
+        file.open(filename, ios::binary);
+        if (!file.is_open() || !(quantum > 0.f))
+            return false;
+        CompressedSceneHeader header = {};
+        memcpy(header.magic, compressedSceneMagic, sizeof(header.magic));
+        header.version = compressedSceneVersion;
+        header.quantum = quantum;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        block.reserve(blockSize + 256);
+        return file.good();
+    }
+
+    void roots(uint32_t count) {
+        putVarint(count);
+    }
+
+    void aggregate(uint32_t childCount) {
+        putByte(BinaryAggregate);
+        putVarint(childCount);
+        endNode();
+    }
+
+    template <typename Shape>
+    void shape(const float* values, uint32_t color) {
+        const BinaryNodeType node = ShapeFormat<Shape>::Record::node;
+        putByte(node);
+        putColor(color);
+        for (size_t k = 0; k < ShapeFormat<Shape>::valueCount; k++)
+            putValue(node, k, values[k]);
+        endNode();
+    }
+
+    // Writes the last block and the end of the file.
+    bool finish() {
+        flushBlock();
+        uint32_t end[2] = { 0, 0 };
+        file.write(reinterpret_cast<const char*>(end), sizeof(end));
+        file.flush();
+        return file.good();
+    }
+};
+
+class CompressedSceneReader {
+private:
+    // Writers end a block after the node that fills blockSize bytes.
+    static const size_t maximumBlock = 1 << 20;
+
+    ifstream file;
+    vector<unsigned char> block;
+    vector<unsigned char> packed;
+    size_t position;
+    bool ended;
+    size_t bytesRead;
+    size_t fileSize;
+    CompressedSceneModel model;
+    float quantum;
+
+    bool nextBlock() {
+        if (ended)
+            return false;
+        uint32_t sizes[2];
+        if (!file.read(reinterpret_cast<char*>(sizes), sizeof(sizes)))
+            return false;
+        bytesRead += sizeof(sizes);
+        if (sizes[0] == 0) {
+            ended = true;
+            return false;
+        }
+        if (sizes[0] > maximumBlock || sizes[1] > sizes[0] || sizes[1] > fileSize - bytesRead)
+            return false;
+        block.resize(sizes[0]);
+        position = 0;
+        if (sizes[1] == sizes[0])
+            file.read(reinterpret_cast<char*>(block.data()), sizes[0]);
+        else {
+            packed.resize(sizes[1]);
+            file.read(reinterpret_cast<char*>(packed.data()), sizes[1]);
+        }
+        if (!file)
+            return false;
+        bytesRead += sizes[1];
+        if (sizes[1] != sizes[0] && !SceneBlockCodec::decompress(packed.data(), packed.size(), block.data(), block.size()))
+            return false;
+        return true;
+    }
+
+    bool getByte(unsigned char& byte) {
+        if (position == block.size() && !nextBlock())
+            return false;
+        byte = block[position++];
+        return true;
+    }
+
+    bool getVarint(uint64_t& value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            unsigned char byte;
+            if (!getByte(byte))
+                return false;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    bool getRaw(void* data, size_t size) {
+        unsigned char* bytes = static_cast<unsigned char*>(data);
+        for (size_t k = 0; k < size; k++)
+            if (!getByte(bytes[k]))
+                return false;
+        return true;
+    }
+
+    bool getValue(BinaryNodeType node, size_t slot, float& value) {
+        uint64_t code;
+        if (!getVarint(code))
+            return false;
+        if (code & 1)
+            return getRaw(&value, sizeof(value));
+        int64_t& previous = model.previous[node][slot];
+        previous += zigzagDecode(code >> 1);
+        value = dequantize(previous, quantum);
+        return true;
+    }
+
+    bool getColor(uint32_t& color) {
+        uint64_t code;
+        if (!getVarint(code))
+            return false;
+        if (code > 0) {
+            if (code > model.palette.size())
+                return false;
+            color = model.palette[code - 1];
+            return true;
+        }
+        if (!getRaw(&color, sizeof(color)))
+            return false;
+        if (model.palette.size() < CompressedSceneModel::maximumPalette)
+            model.palette.push_back(color);
+        return true;
+    }
+
+public:
+    CompressedSceneReader() : position(0), ended(false), bytesRead(0), fileSize(0), quantum(compressedSceneQuantum) {}
+
+    bool open(const string& filename) {
+        file.open(filename, ios::binary);
+        if (!file.is_open())
+            return false;
+        file.seekg(0, ios::end);
+        fileSize = static_cast<size_t>(file.tellg());
+        file.seekg(0, ios::beg);
+        CompressedSceneHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            return false;
+        bytesRead = sizeof(header);
+        quantum = header.quantum;
+        return memcmp(header.magic, compressedSceneMagic, sizeof(header.magic)) == 0 &&
+            header.version == compressedSceneVersion && quantum > 0.f;
+    }
+
+    bool readRoots(uint32_t& count) {
+        uint64_t value;
+        if (!getVarint(value) || value > UINT32_MAX)
+            return false;
+        count = static_cast<uint32_t>(value);
+        return true;
+    }
+
+    bool readNode(BinaryNodeType& node) {
+        unsigned char byte;
+        if (!getByte(byte) || byte > BinaryAggregate)
+            return false;
+        node = static_cast<BinaryNodeType>(byte);
+        return true;
+    }
+
+    bool readChildCount(uint32_t& count) {
+        return readRoots(count);
+    }
+
+    template <typename Shape>
+    bool readShape(float* values, uint32_t& color) {
+        const BinaryNodeType node = ShapeFormat<Shape>::Record::node;
+        if (!getColor(color))
+            return false;
+        for (size_t k = 0; k < ShapeFormat<Shape>::valueCount; k++)
+            if (!getValue(node, k, values[k]))
+                return false;
+        return true;
+    }
+
+    // True once the stream is used up and the end of the file was read.
+    bool finish() {
+        return position == block.size() && !nextBlock() && ended;
+    }
+
+    size_t getBytesRead() const {
+        return bytesRead;
+    }
+
+    size_t getFileSize() const {
+        return fileSize;
+    }
+};
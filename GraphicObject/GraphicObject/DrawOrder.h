@@ -0,0 +1,71 @@
+﻿#pragma once
+
+#include <vector>
+#include "GraphicObject.h"
+
+using namespace std;
+
+// Leaf handles of the scene in draw order (the objects vector, with Aggregate
+// children in place), plus per-slot lookups of the draw position and the
+// top-level object a shape belongs to. Rebuilt only when the store structure changes.
+class DrawOrder {
+private:
+    vector<ShapeHandle> handles;
+    vector<unsigned> slotOrder;
+    vector<int> slotRoot;
+    unsigned cachedStructure;
+    size_t cachedRoots;
+    bool valid;
+
+public:
+    DrawOrder() : cachedStructure(0), cachedRoots(0), valid(false) {}
+
+    // Returns true if the order was rebuilt.
+    bool update(const ShapeStore& store, const vector<GraphicObject*>& objects) {
+        if (valid && cachedStructure == store.getStructureVersion() && cachedRoots == objects.size())
+            return false;
+        handles.clear();
+        fill(slotRoot.begin(), slotRoot.end(), -1);
+        for (size_t root = 0; root < objects.size(); root++) {
+            size_t first = handles.size();
+            objects[root]->collectHandles(handles);
+            for (size_t k = first; k < handles.size(); k++) {
+                unsigned slot = handles[k].slot;
+                if (slot >= slotOrder.size()) {
+                    slotOrder.resize(slot + 1, 0);
+                    slotRoot.resize(slot + 1, -1);
+                }
+                slotOrder[slot] = static_cast<unsigned>(k);
+                slotRoot[slot] = static_cast<int>(root);
+            }
+        }
+        cachedStructure = store.getStructureVersion();
+        cachedRoots = objects.size();
+        valid = true;
+        return true;
+    }
+
+    void invalidate() {
+        valid = false;
+    }
+
+    const vector<ShapeHandle>& getHandles() const {
+        return handles;
+    }
+
+    unsigned orderOf(ShapeHandle handle) const {
+        return slotOrder[handle.slot];
+    }
+
+    // Index of the top-level object containing the shape, or -1.
+    int rootOf(ShapeHandle handle) const {
+        return handle.slot < slotRoot.size() ? slotRoot[handle.slot] : -1;
+    }
+
+    // Sorts handles back to front.
+    void sort(vector<ShapeHandle>& subset) const {
+        std::sort(subset.begin(), subset.end(), [this](ShapeHandle a, ShapeHandle b) {
+            return slotOrder[a.slot] < slotOrder[b.slot];
+        });
+    }
+};
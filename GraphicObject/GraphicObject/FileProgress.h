@@ -0,0 +1,26 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+using namespace std;
+
+// Progress of a long file operation, written by the thread doing the work and
+// read by any other. Setting cancelled asks the worker to stop at its next check.
+struct FileProgress {
+    atomic<size_t> done;
+    atomic<size_t> total;
+    atomic<bool> cancelled;
+
+    // Workers update done and look at cancelled once per this many items.
+    static const size_t step = 4096;
+
+    FileProgress() : done(0), total(0), cancelled(false) {}
+
+    // In [0, 1]; 0 while the total is not known yet.
+    double fraction() const {
+        size_t all = total;
+        return all ? min(1.0, static_cast<double>(done) / all) : 0.0;
+    }
+};
@@ -0,0 +1,266 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The built-in font, used when no font file can be found: 5x7 glyphs of the
+// printable ASCII characters, one byte per column with the top row in bit 0.
+const unsigned char bitmapFontFirst = 32;
+const unsigned char bitmapFontLast = 126;
+const unsigned bitmapFontColumns = 5;
+const unsigned bitmapFontRows = 7;
+// Glyph cell including the spacing to the next character and line.
+const unsigned bitmapFontCellWidth = 6;
+const unsigned bitmapFontCellHeight = 9;
+
+const unsigned char bitmapFontGlyphs[][bitmapFontColumns] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5F, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, // space ! "
+    { 0x14, 0x7F, 0x14, 0x7F, 0x14 }, { 0x24, 0x2A, 0x7F, 0x2A, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, // # $ %
+    { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 }, { 0x00, 0x1C, 0x22, 0x41, 0x00 }, // & ' (
+    { 0x00, 0x41, 0x22, 0x1C, 0x00 }, { 0x08, 0x2A, 0x1C, 0x2A, 0x08 }, { 0x08, 0x08, 0x3E, 0x08, 0x08 }, // ) * +
+    { 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x60, 0x60, 0x00, 0x00 }, // , - .
+    { 0x20, 0x10, 0x08, 0x04, 0x02 }, { 0x3E, 0x51, 0x49, 0x45, 0x3E }, { 0x00, 0x42, 0x7F, 0x40, 0x00 }, // / 0 1
+    { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4B, 0x31 }, { 0x18, 0x14, 0x12, 0x7F, 0x10 }, // 2 3 4
+    { 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3C, 0x4A, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 }, // 5 6 7
+    { 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1E }, { 0x00, 0x36, 0x36, 0x00, 0x00 }, // 8 9 :
+    { 0x00, 0x56, 0x36, 0x00, 0x00 }, { 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, // ; < =
+    { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 }, { 0x32, 0x49, 0x79, 0x41, 0x3E }, // > ? @
+    { 0x7E, 0x11, 0x11, 0x11, 0x7E }, { 0x7F, 0x49, 0x49, 0x49, 0x36 }, { 0x3E, 0x41, 0x41, 0x41, 0x22 }, // A B C
+    { 0x7F, 0x41, 0x41, 0x22, 0x1C }, { 0x7F, 0x49, 0x49, 0x49, 0x41 }, { 0x7F, 0x09, 0x09, 0x01, 0x01 }, // D E F
+    { 0x3E, 0x41, 0x41, 0x51, 0x32 }, { 0x7F, 0x08, 0x08, 0x08, 0x7F }, { 0x00, 0x41, 0x7F, 0x41, 0x00 }, // G H I
+    { 0x20, 0x40, 0x41, 0x3F, 0x01 }, { 0x7F, 0x08, 0x14, 0x22, 0x41 }, { 0x7F, 0x40, 0x40, 0x40, 0x40 }, // J K L
+    { 0x7F, 0x02, 0x04, 0x02, 0x7F }, { 0x7F, 0x04, 0x08, 0x10, 0x7F }, { 0x3E, 0x41, 0x41, 0x41, 0x3E }, // M N O
+    { 0x7F, 0x09, 0x09, 0x09, 0x06 }, { 0x3E, 0x41, 0x51, 0x21, 0x5E }, { 0x7F, 0x09, 0x19, 0x29, 0x46 }, // P Q R
+    { 0x46, 0x49, 0x49, 0x49, 0x31 }, { 0x01, 0x01, 0x7F, 0x01, 0x01 }, { 0x3F, 0x40, 0x40, 0x40, 0x3F }, // S T U
+    { 0x1F, 0x20, 0x40, 0x20, 0x1F }, { 0x7F, 0x20, 0x18, 0x20, 0x7F }, { 0x63, 0x14, 0x08, 0x14, 0x63 }, // V W X
+    { 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7F, 0x41, 0x41, 0x00 }, // Y Z [
+    { 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7F, 0x00 }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, // \ ] ^
+    { 0x40, 0x40, 0x40, 0x40, 0x40 }, { 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, // _ ` a
+    { 0x7F, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 }, { 0x38, 0x44, 0x44, 0x48, 0x7F }, // b c d
+    { 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x08, 0x7E, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3C }, // e f g
+    { 0x7F, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7D, 0x40, 0x00 }, { 0x20, 0x40, 0x44, 0x3D, 0x00 }, // h i j
+    { 0x00, 0x7F, 0x10, 0x28, 0x44 }, { 0x00, 0x41, 0x7F, 0x40, 0x00 }, { 0x7C, 0x04, 0x18, 0x04, 0x78 }, // k l m
+    { 0x7C, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 }, { 0x7C, 0x14, 0x14, 0x14, 0x08 }, // n o p
+    { 0x08, 0x14, 0x14, 0x18, 0x7C }, { 0x7C, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 }, // q r s
+    { 0x04, 0x3F, 0x44, 0x40, 0x20 }, { 0x3C, 0x40, 0x40, 0x20, 0x7C }, { 0x1C, 0x20, 0x40, 0x20, 0x1C }, // t u v
+    { 0x3C, 0x40, 0x30, 0x40, 0x3C }, { 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0C, 0x50, 0x50, 0x50, 0x3C }, // w x y
+    { 0x44, 0x64, 0x54, 0x4C, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 }, { 0x00, 0x00, 0x7F, 0x00, 0x00 }, // z { |
+    { 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x08, 0x04, 0x08, 0x10, 0x08 }                                    // } ~
+};
+
+// The fonts of the window's overlays, loaded once for the whole session.
+//
+// The first font file found among the candidates is loaded on first use, not
+// at startup, and the glyphs of every character size in use are rendered into
+// the font's atlas up front, so drawing text never touches the disk or the
+// rasterizer again. When no file is found the built-in bitmap font is used
+// instead; its atlas is a texture made from the table above.
+class FontCache {
+private:
+    vector<string> candidates;
+    sf::Font font;
+    bool attempted;
+    bool loaded;
+    string path;
+    vector<unsigned> warmSizes;
+
+    sf::Texture fallbackAtlas;
+    bool fallbackReady;
+
+    static bool exists(const string& filename) {
+        ifstream file(filename, ios::binary);
+        return file.is_open();
+    }
+
+public:
+    FontCache() : attempted(false), loaded(false), fallbackReady(false) {
+        if (const char* configured = getenv("GRAPHICOBJECT_FONT"))
+            candidates.push_back(configured);
+        candidates.push_back("D:/Font_arial/arial.ttf");
+        candidates.push_back("C:/Windows/Fonts/arial.ttf");
+        candidates.push_back("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+        candidates.push_back("/usr/share/fonts/TTF/DejaVuSans.ttf");
+        candidates.push_back("/usr/share/fonts/dejavu/DejaVuSans.ttf");
+        candidates.push_back("/System/Library/Fonts/Supplemental/Arial.ttf");
+    }
+
+    FontCache(const FontCache&) = delete;
+    FontCache& operator=(const FontCache&) = delete;
+
+    // Tried before all others; call before the first getFont().
+    void preferFile(const string& filename) {
+        candidates.insert(candidates.begin(), filename);
+    }
+
+    // nullptr when no candidate could be loaded.
+    const sf::Font* getFont() {
+        if (!attempted) {
+            attempted = true;
+            for (auto& candidate : candidates) {
+                // Checked first so that missing files do not each print an error.
+                if (exists(candidate) && font.loadFromFile(candidate)) {
+                    loaded = true;
+                    path = candidate;
+                    break;
+                }
+            }
+        }
+        return loaded ? &font : nullptr;
+    }
+
+    // The file the font came from; empty with the built-in font.
+    const string& getFontPath() {
+        getFont();
+        return path;
+    }
+
+    // Renders the printable ASCII glyphs of a size into the font's atlas, once.
+    void warm(unsigned characterSize) {
+        const sf::Font* loadedFont = getFont();
+        if (!loadedFont)
+            return;
+        for (unsigned size : warmSizes)
+            if (size == characterSize)
+                return;
+        warmSizes.push_back(characterSize);
+        for (sf::Uint32 c = bitmapFontFirst; c <= bitmapFontLast; c++)
+            loadedFont->getGlyph(c, characterSize, false);
+    }
+
+    // The built-in glyphs side by side, white where set, in cells of
+    // bitmapFontCellWidth by bitmapFontRows texels.
+    const sf::Texture& getFallbackAtlas() {
+        if (!fallbackReady) {
+            const unsigned count = bitmapFontLast - bitmapFontFirst + 1;
+            const unsigned width = count * bitmapFontCellWidth;
+            vector<sf::Uint8> pixels(width * bitmapFontRows * 4, 0);
+            for (unsigned g = 0; g < count; g++) {
+                for (unsigned column = 0; column < bitmapFontColumns; column++) {
+                    for (unsigned row = 0; row < bitmapFontRows; row++) {
+                        if (!(bitmapFontGlyphs[g][column] >> row & 1))
+                            continue;
+                        sf::Uint8* pixel = &pixels[(row * width + g * bitmapFontCellWidth + column) * 4];
+                        pixel[0] = pixel[1] = pixel[2] = pixel[3] = 255;
+                    }
+                }
+            }
+            fallbackAtlas.create(width, bitmapFontRows);
+            fallbackAtlas.update(pixels.data());
+            fallbackReady = true;
+        }
+        return fallbackAtlas;
+    }
+};
+
+// A block of overlay text drawn with the cached font, or with the built-in
+// one at a whole multiple of its size close to the character size asked for.
+// Nothing is loaded until the first string is set, and setting the string it
+// already shows costs nothing, so it can be set every frame.
+class OverlayText : public sf::Drawable, public sf::Transformable {
+private:
+    FontCache& fonts;
+    unsigned characterSize;
+    sf::Color color;
+    string text;
+    sf::Text label;
+    sf::VertexArray quads;
+    sf::FloatRect bounds;
+
+    // Triangles of the built-in glyphs, one cell per character.
+    void layoutFallback() {
+        const float scale = static_cast<float>(max(1u, (characterSize + bitmapFontRows / 2) / bitmapFontRows));
+        quads.setPrimitiveType(sf::Triangles);
+        quads.clear();
+        float x = 0.f, y = 0.f, width = 0.f;
+        for (char c : text) {
+            if (c == '\n') {
+                x = 0.f;
+                y += bitmapFontCellHeight * scale;
+                continue;
+            }
+            unsigned char code = static_cast<unsigned char>(c);
+            if (code < bitmapFontFirst || code > bitmapFontLast)
+                code = '?';
+            if (code != ' ') {
+                float u = static_cast<float>((code - bitmapFontFirst) * bitmapFontCellWidth);
+                float right = x + bitmapFontColumns * scale, bottom = y + bitmapFontRows * scale;
+                sf::Vertex topLeft(sf::Vector2f(x, y), color, sf::Vector2f(u, 0.f));
+                sf::Vertex topRight(sf::Vector2f(right, y), color, sf::Vector2f(u + bitmapFontColumns, 0.f));
+                sf::Vertex bottomRight(sf::Vector2f(right, bottom), color, sf::Vector2f(u + bitmapFontColumns, static_cast<float>(bitmapFontRows)));
+                sf::Vertex bottomLeft(sf::Vector2f(x, bottom), color, sf::Vector2f(u, static_cast<float>(bitmapFontRows)));
+                quads.append(topLeft);
+                quads.append(topRight);
+                quads.append(bottomRight);
+                quads.append(topLeft);
+                quads.append(bottomRight);
+                quads.append(bottomLeft);
+            }
+            x += bitmapFontCellWidth * scale;
+            width = max(width, x);
+        }
+        float height = text.empty() ? 0.f : y + bitmapFontRows * scale;
+        bounds = sf::FloatRect(0.f, 0.f, width, height);
+    }
+
+    void layout() {
+        if (const sf::Font* font = fonts.getFont()) {
+            fonts.warm(characterSize);
+            label.setFont(*font);
+            label.setCharacterSize(characterSize);
+            label.setFillColor(color);
+            label.setString(text);
+            bounds = label.getLocalBounds();
+        }
+        else {
+            layoutFallback();
+        }
+    }
+
+protected:
+    void draw(sf::RenderTarget& target, sf::RenderStates states) const override {
+        states.transform *= getTransform();
+        if (fonts.getFont()) {
+            target.draw(label, states);
+        }
+        else {
+            states.texture = &fonts.getFallbackAtlas();
+            target.draw(quads, states);
+        }
+    }
+
+public:
+    OverlayText(FontCache& fonts, unsigned characterSize = 14, sf::Color color = sf::Color::White)
+        : fonts(fonts), characterSize(characterSize), color(color), quads(sf::Triangles) {}
+
+    void setString(const string& value) {
+        if (value == text)
+            return;
+        text = value;
+        layout();
+    }
+
+    const string& getString() const {
+        return text;
+    }
+
+    void setFillColor(sf::Color value) {
+        if (value == color)
+            return;
+        color = value;
+        layout();
+    }
+
+    sf::FloatRect getLocalBounds() const {
+        return bounds;
+    }
+
+    sf::FloatRect getGlobalBounds() const {
+        return getTransform().transformRect(bounds);
+    }
+};
@@ -0,0 +1,213 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Last `capacity` samples of one quantity, with percentiles over that window.
+class RollingStats {
+private:
+    vector<double> samples;
+    size_t next;
+    size_t count;
+
+public:
+    RollingStats(size_t capacity = 240) : samples(capacity, 0.0), next(0), count(0) {}
+
+    void add(double value) {
+        samples[next] = value;
+        next = (next + 1) % samples.size();
+        count = min(count + 1, samples.size());
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // p in [0, 1]; 0 when there are no samples.
+    double percentile(double p) const {
+        if (count == 0)
+            return 0.0;
+        vector<double> sorted(samples.begin(), samples.begin() + count);
+        size_t rank = min(static_cast<size_t>(p * count), count - 1);
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    double mean() const {
+        double sum = 0.0;
+        for (size_t i = 0; i < count; i++)
+            sum += samples[i];
+        return count ? sum / count : 0.0;
+    }
+};
+
+// Times named phases of the main loop. Phase totals are accumulated per frame
+// and kept as rolling statistics next to the frame time itself; every timed
+// span also goes into a bounded ring of trace events that can be written out
+// in the Chrome trace format (chrome://tracing, Perfetto).
+// Phase names must be string literals: only the pointer is stored.
+class FrameProfiler {
+private:
+    struct Phase {
+        const char* name;
+        double frameSeconds;
+        RollingStats stats;
+    };
+
+    struct TraceEvent {
+        const char* name;
+        int64_t start;      // microseconds since the profiler was created
+        int64_t duration;
+        uint32_t thread;
+    };
+
+    using Clock = chrono::steady_clock;
+
+    Clock::time_point origin;
+    Clock::time_point frameStart;
+    bool inFrame;
+    RollingStats frames;
+    vector<Phase> phases;
+    vector<TraceEvent> trace;
+    size_t traceNext;
+    bool traceWrapped;
+    mutable mutex lock;
+
+    int64_t microseconds(Clock::time_point time) const {
+        return chrono::duration_cast<chrono::microseconds>(time - origin).count();
+    }
+
+    static uint32_t threadId() {
+        return static_cast<uint32_t>(hash<thread::id>()(this_thread::get_id()) & 0x7fffffff);
+    }
+
+    void addEvent(const char* name, Clock::time_point start, Clock::time_point end) {
+        TraceEvent& event = trace[traceNext];
+        event.name = name;
+        event.start = microseconds(start);
+        event.duration = chrono::duration_cast<chrono::microseconds>(end - start).count();
+        event.thread = threadId();
+        traceNext++;
+        if (traceNext == trace.size()) {
+            traceNext = 0;
+            traceWrapped = true;
+        }
+    }
+
+    Phase& phase(const char* name) {
+        for (auto& existing : phases)
+            if (existing.name == name || strcmp(existing.name, name) == 0)
+                return existing;
+        phases.push_back({ name, 0.0, RollingStats() });
+        return phases.back();
+    }
+
+public:
+    FrameProfiler(size_t traceCapacity = 1 << 16)
+        : origin(Clock::now()), inFrame(false), trace(max<size_t>(traceCapacity, 1)), traceNext(0), traceWrapped(false) {}
+
+    FrameProfiler(const FrameProfiler&) = delete;
+    FrameProfiler& operator=(const FrameProfiler&) = delete;
+
+    void beginFrame() {
+        lock_guard<mutex> guard(lock);
+        frameStart = Clock::now();
+        inFrame = true;
+        for (auto& entry : phases)
+            entry.frameSeconds = 0.0;
+    }
+
+    void endFrame() {
+        Clock::time_point end = Clock::now();
+        lock_guard<mutex> guard(lock);
+        if (!inFrame)
+            return;
+        inFrame = false;
+        frames.add(chrono::duration<double>(end - frameStart).count());
+        for (auto& entry : phases)
+            entry.stats.add(entry.frameSeconds);
+        addEvent("frame", frameStart, end);
+    }
+
+    // Called by ScopedTimer; spans outside a frame only go into the trace.
+    void record(const char* name, Clock::time_point start, Clock::time_point end) {
+        lock_guard<mutex> guard(lock);
+        if (inFrame)
+            phase(name).frameSeconds += chrono::duration<double>(end - start).count();
+        addEvent(name, start, end);
+    }
+
+    const RollingStats& getFrameStats() const {
+        return frames;
+    }
+
+    // Frame and per-phase timings in milliseconds, one line each.
+    string summary() const {
+        lock_guard<mutex> guard(lock);
+        ostringstream text;
+        text.setf(ios::fixed);
+        text.precision(2);
+        text << "frame  p50 " << frames.percentile(0.5) * 1000.0 << "  p99 " << frames.percentile(0.99) * 1000.0 << " ms";
+        for (auto& entry : phases)
+            text << "\n" << entry.name << "  p50 " << entry.stats.percentile(0.5) * 1000.0
+                 << "  p99 " << entry.stats.percentile(0.99) * 1000.0 << " ms";
+        return text.str();
+    }
+
+    // Writes the recorded spans, oldest first, as a Chrome trace JSON file.
+    bool writeTrace(const string& filename) const {
+        lock_guard<mutex> guard(lock);
+        ofstream file(filename);
+        if (!file.is_open())
+            return false;
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        size_t count = traceWrapped ? trace.size() : traceNext;
+        size_t first = traceWrapped ? traceNext : 0;
+        for (size_t k = 0; k < count; k++) {
+            const TraceEvent& event = trace[(first + k) % trace.size()];
+            file << (k ? ",\n" : "\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+                 << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+        }
+        file << "\n]}\n";
+        file.flush();
+        return file.good();
+    }
+};
+
+// Times the enclosing scope (or until stop()) as one phase of the profiler.
+class ScopedTimer {
+private:
+    FrameProfiler& profiler;
+    const char* name;
+    chrono::steady_clock::time_point start;
+    bool running;
+
+public:
+    ScopedTimer(FrameProfiler& profiler, const char* name)
+        : profiler(profiler), name(name), start(chrono::steady_clock::now()), running(true) {}
+
+    ~ScopedTimer() {
+        stop();
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    void stop() {
+        if (running) {
+            running = false;
+            profiler.record(name, start, chrono::steady_clock::now());
+        }
+    }
+};
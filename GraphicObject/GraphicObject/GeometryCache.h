@@ -0,0 +1,84 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <array>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+// Same tessellation as the sf::CircleShape default.
+const size_t circlePointCount = 30;
+
+// Circle tessellations, one per level of detail. They are stored at unit size
+// around the origin; a circle only adds its own scale, position and color when
+// its vertices are generated, so each level is computed once rather than once
+// per circle.
+//
+// The renderer passes the on-screen radius and gets the coarsest level whose
+// outline stays within circleTolerance pixels of the true circle. Level 0 is a
+// square of the same area for circles smaller than a pixel.
+class GeometryCache {
+public:
+    // Segment counts of the circle levels; 0 stands for the square.
+    static constexpr array<size_t, 10> circleLevels = { 0, 8, 12, 16, 24, 32, 48, 64, 96, 128 };
+    // Largest distance, in pixels, between a tessellated and the true outline.
+    static constexpr float circleTolerance = 0.25f;
+
+private:
+    static vector<sf::Vector2f> tessellateCircle(size_t pointCount) {
+        const float step = 2.f * 3.141592654f / pointCount;
+        vector<sf::Vector2f> outline;
+        outline.push_back(sf::Vector2f(0.f, -1.f));
+        for (size_t k = 1; k < pointCount; k++) {
+            float angle = k * step - 3.141592654f / 2.f;
+            outline.push_back(sf::Vector2f(cos(angle), sin(angle)));
+        }
+        // A fan from the top point.
+        vector<sf::Vector2f> corners;
+        for (size_t k = 2; k < pointCount; k++) {
+            corners.push_back(outline[0]);
+            corners.push_back(outline[k - 1]);
+            corners.push_back(outline[k]);
+        }
+        return corners;
+    }
+
+    // Two triangles covering the same area as the unit circle.
+    static vector<sf::Vector2f> tessellateSquare() {
+        const float half = sqrt(3.141592654f) / 2.f;
+        sf::Vector2f a(-half, -half), b(half, -half), c(half, half), d(-half, half);
+        return { a, b, c, a, c, d };
+    }
+
+public:
+    // sf::Triangles corners of the circle of radius 1 around the origin.
+    // Built once, on first use, and safe to read from any thread.
+    static const vector<sf::Vector2f>& unitCircle() {
+        static const vector<sf::Vector2f> corners = tessellateCircle(circlePointCount);
+        return corners;
+    }
+
+    static const vector<sf::Vector2f>& unitCircle(size_t level) {
+        static const array<vector<sf::Vector2f>, circleLevels.size()> levels = [] {
+            array<vector<sf::Vector2f>, circleLevels.size()> built;
+            built[0] = tessellateSquare();
+            for (size_t k = 1; k < circleLevels.size(); k++)
+                built[k] = tessellateCircle(circleLevels[k]);
+            return built;
+        }();
+        return levels[level];
+    }
+
+    // The level for a circle of the given radius in pixels.
+    static size_t circleLevel(float screenRadius) {
+        if (!(screenRadius >= 0.5f))
+            return 0;
+        // An n-gon strays r * (1 - cos(pi / n)) from its circle.
+        float limit = 1.f - circleTolerance / screenRadius;
+        for (size_t k = 1; k < circleLevels.size(); k++)
+            if (cos(3.141592654f / circleLevels[k]) >= limit)
+                return k;
+        return circleLevels.size() - 1;
+    }
+};
@@ -1,583 +1,534 @@
 ﻿#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
 #include <vector>
+#include "FontCache.h"
+#include "FrameProfiler.h"
+#include "GraphicObject.h"
+#include "InputReplay.h"
+#include "OverlayDialog.h"
+#include "Scene.h"
+#include "SceneCommandQueue.h"
+#include "SceneEditor.h"
+#include "SceneFiles.h"
+#include "SceneFileTask.h"
+#include "SceneJournal.h"
+#include "SceneRenderer.h"
+#include "SoftwareRasterizer.h"
+#include "SpatialGrid.h"
+#include "TiledRasterizer.h"
+#include "UndoHistory.h"
 
 using namespace std;
 
-class GraphicObject {
-public:
-    virtual void draw(sf::RenderWindow& window) = 0;
-    virtual void move(float x, float y) = 0;
-    virtual void save(ofstream& file) = 0;
-    virtual void load(ifstream& file) = 0;
-    virtual void changeColor(sf::Color color) = 0;
-    virtual void changeSize(float size) = 0;    
-    virtual void setVisible(bool visible) = 0;
-    virtual bool isVisible() = 0;
-};
-
-class Circle : public GraphicObject {
-private:
-    sf::CircleShape shape;
-    sf::Color fillColor;
-    bool visible;
-
-public:
-    Circle(float radius = 10.f) {
-        shape.setRadius(radius);
-        shape.setFillColor(sf::Color::White);
-        shape.setPosition(100.f, 100.f);
-        visible = true;
-    }
-
-    void draw(sf::RenderWindow& window) override {
-        window.draw(shape);
-    } 
-    void move(float x, float y) override {
-        shape.move(x, y);
-    }
-
-    void save(ofstream& file) override {
-        file << "Circle" << endl;
-        file << shape.getPosition().x << " " << shape.getPosition().y << endl;
-        file << shape.getRadius() << endl;
-        file << shape.getFillColor().toInteger() << endl;
-    }
-
-    void load(ifstream& file) override {
-        float x, y, radius;
-        sf::Uint32 color;
-        file >> x >> y >> radius >> color;
-        shape.setPosition(x, y);
-        shape.setRadius(radius);
-        shape.setFillColor(sf::Color(color));
-    }
-
-    void changeColor(sf::Color color) override {
-        fillColor = color;
-        shape.setFillColor(color);
-    }
-
-    void changeSize(float size) override {
-        shape.setRadius(size);
-    }
-
-    void setVisible(bool visible) override {
-        this->visible = visible;
-        if (visible)
-            shape.setFillColor(fillColor);
-        else
-            shape.setFillColor(sf::Color::Transparent);
-    }
-
-    bool isVisible() override {
-        return visible;
-    }
-};
-
-class Rectangle : public GraphicObject {
-private:
-    sf::RectangleShape shape;
-    bool visible;
-    sf::Color fillColor;
-
-public:
-    Rectangle(float width = 20.f, float height = 30.f) {
-        shape.setSize(sf::Vector2f(width, height));
-        shape.setFillColor(sf::Color::White);
-        shape.setPosition(200.f, 100.f);
-        visible = true;
-    }
-
-    void draw(sf::RenderWindow& window) override {
-        window.draw(shape);
-    }
-
-    void move(float x, float y) override {
-        shape.move(x, y);
-    }
-
-    void save(ofstream& file) override {
-        file << "Rectangle" << endl;
-        file << shape.getPosition().x << " " << shape.getPosition().y << endl;
-        file << shape.getSize().x << " " << shape.getSize().y << endl;
-        file << shape.getFillColor().toInteger() << endl;
-    }
-
-    void load(ifstream& file) override {
-        float x, y, width, height;
-        sf::Uint32 color;
-        file >> x >> y >> width >> height >> color;
-        shape.setPosition(x, y);
-        shape.setSize(sf::Vector2f(width, height));
-        shape.setFillColor(sf::Color(color));
-    }
-
-    void changeColor(sf::Color color) override {
-        fillColor = color;
-        shape.setFillColor(color);
-    }
-
-    void changeSize(float size) override {
-        sf::Vector2f newSize(size * (shape.getSize().x / max(shape.getSize().x, shape.getSize().y)), size * (shape.getSize().y / max(shape.getSize().x, shape.getSize().y)));
-        shape.setSize(newSize);
-    }
-
-    void setVisible(bool visible) override {
-        this->visible = visible;
-        if (visible)
-            shape.setFillColor(fillColor);
-        else
-            shape.setFillColor(sf::Color::Transparent);
-    }
-
-    bool isVisible() override {
-        return visible;
-    }
-};
-
-class Triangle : public GraphicObject {
-private:
-    sf::ConvexShape shape;
-    sf::Color fillColor;
-    bool visible;
-
-public:
-    Triangle(float size = 20.f) {
-        shape.setPointCount(3);
-        shape.setPoint(0, sf::Vector2f(0.f, -size));
-        shape.setPoint(1, sf::Vector2f(size * sqrt(3) / 2, size / 2));
-        shape.setPoint(2, sf::Vector2f(-size * sqrt(3) / 2, size / 2));
-        shape.setFillColor(sf::Color::White);
-        shape.setPosition(300.f, 100.f);
-        visible = true;
-    }
-
-    void draw(sf::RenderWindow& window) override {
-        window.draw(shape);
-    }
-
-    void move(float x, float y) override {
-        shape.move(x, y);
-    }
-
-    void save(ofstream& file) override {
-        file << "Triangle" << endl;
-        file << shape.getPosition().x << " " << shape.getPosition().y << endl;
-        file << shape.getPoint(0).x << " " << shape.getPoint(0).y << " "
-             << shape.getPoint(1).x << " " << shape.getPoint(1).y << " "
-             << shape.getPoint(2).x << " " << shape.getPoint(2).y << endl;
-        file << shape.getFillColor().toInteger() << endl;
-    }
-
-    void load(ifstream& file) override {
-        float x, y, x0, y0, x1, y1, x2, y2;
-        sf::Uint32 color;
-        file >> x >> y >> x0 >> y0 >> x1 >> y1 >> x2 >> y2 >> color;
-        shape.setPosition(x, y);
-        shape.setPoint(0, sf::Vector2f(x0, y0));
-        shape.setPoint(1, sf::Vector2f(x1, y1));
-        shape.setPoint(2, sf::Vector2f(x2, y2));
-        shape.setFillColor(sf::Color(color));
-    }
-
-    void changeColor(sf::Color color) override {
-        fillColor = color;
-        shape.setFillColor(color);
-    }
-
-    void changeSize(float size) override {
-        float currentSize = sqrt(pow(shape.getPoint(0).x, 2) + pow(shape.getPoint(0).y, 2));
-        float scaleFactor = size / currentSize;
-        for (int i = 0; i < 3; i++) {
-            float newX = shape.getPoint(i).x * scaleFactor;
-            float newY = shape.getPoint(i).y * scaleFactor;
-            shape.setPoint(i, sf::Vector2f(newX, newY));
+// Compares the stream-based Aggregate::load path with TextSceneParser on one file.
+static int benchmarkTextLoad(const string& filename) {
+    ifstream probe(filename, ios::binary | ios::ate);
+    if (!probe.is_open()) {
+        cerr << "Cannot open " << filename << endl;
+        return 1;
+    }
+    double megabytes = static_cast<double>(probe.tellg()) / (1024.0 * 1024.0);
+
+    auto start = chrono::steady_clock::now();
+    {
+        Scene scene;
+        ifstream file(filename);
+        Aggregate root(scene.store, scene.arena);
+        root.load(file);
+    }
+    double streamSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    size_t loaded = 0;
+    {
+        Scene scene;
+        string error;
+        if (!loadTextScene(filename, scene, &error)) {
+            cerr << error << endl;
+            return 1;
         }
+        loaded = scene.store.size();
     }
+    double parserSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    void setVisible(bool visible) override {
-        this->visible = visible;
-        if (visible)
-            shape.setFillColor(fillColor);
-        else
-            shape.setFillColor(sf::Color::Transparent);
-    }
-
-    bool isVisible() override {
-        return visible;
-    }
-};
-
-class Aggregate : public GraphicObject {
-private:
-    vector<GraphicObject*> objects;
-    bool visible;
-
-public:
-    void addObject(GraphicObject* object) {
-        objects.push_back(object);
+    cout << filename << ": " << megabytes << " MB, " << loaded << " shapes" << endl;
+    cout << "ifstream loader: " << megabytes / streamSeconds << " MB/s" << endl;
+    cout << "streaming parser: " << megabytes / parserSeconds << " MB/s" << endl;
+    return 0;
+}
+
+// Runs a recorded or written input script without a window and reports the
+// latency of each command and the checksum of the final scene, to stdout or
+// to a file.
+static int replayScript(const string& script, const string& reportFile) {
+    InputReplay replay;
+    if (!replay.run(script)) {
+        cerr << script << ":" << replay.getErrorLine() << ": " << replay.getError() << endl;
+        return 1;
+    }
+    if (reportFile.empty()) {
+        replay.writeReport(cout);
+        return 0;
+    }
+    ofstream report(reportFile);
+    replay.writeReport(report);
+    if (!report.good()) {
+        cerr << "Cannot write " << reportFile << endl;
+        return 1;
     }
-
-    void draw(sf::RenderWindow& window) {
-        for (auto object : objects) {
-            object->draw(window);
+    return 0;
+}
+
+// Stands in for an external simulation: creates a field of circles, then
+// sends `rate` moves and recolors per 1/60 s through the command queue until
+// stopped. Commands that do not fit are dropped, as a real producer might.
+static void runSimulation(SceneCommandQueue& commands, const atomic<bool>& stop, unsigned rate) {
+    const uint32_t count = 1000;
+    for (uint32_t id = 0; id < count; id++) {
+        while (!commands.push(SceneCommand::create(id, BinaryCircle)) && !stop)
+            this_thread::yield();
+        commands.push(SceneCommand::move(id, static_cast<float>(id % 40) * 20.f - 90.f, static_cast<float>(id / 40) * 20.f - 90.f));
+    }
+    mt19937 random(1);
+    uniform_real_distribution<float> step(-2.f, 2.f);
+    const sf::Color colors[] = { sf::Color::Red, sf::Color::Green, sf::Color::Blue };
+    while (!stop) {
+        for (unsigned k = 0; k < rate; k++) {
+            uint32_t id = random() % count;
+            if (k % 16 == 0)
+                commands.push(SceneCommand::recolor(id, colors[random() % 3]));
+            else
+                commands.push(SceneCommand::move(id, step(random), step(random)));
         }
-    }
-
-    void move(float x, float y) {
-        for (auto object : objects) {
-            object->move(x, y);
+        this_thread::sleep_for(chrono::microseconds(16667));
+    }
+}
+
+// The F1 dialog.
+static const char* const helpText =
+    "Commands:\n"
+    "C - create circle\n"
+    "R - create rectangle\n"
+    "T - create triangle\n"
+    "A - create aggregate\n"
+    "Tab - switch between objects\n"
+    "Up/Down/Left/Right - move object\n"
+    "E - toggle trail\n"
+    "S - save state to file\n"
+    "L - load state from file\n"
+    "Esc - cancel a running save or load\n"
+    "1 - change color to red\n"
+    "2 - change color to green\n"
+    "3 - change color to blue\n"
+    "+ - increase size\n"
+    "- - decrease size\n"
+    "V - toggle visibility\n"
+    "Ctrl+Z / Ctrl+Y - undo / redo\n"
+    "F2 - show frame timings\n"
+    "F3 - write trace.json\n"
+    "Left click - select object under cursor";
+
+// Draws the profiler summary in the top-left corner over a dark backdrop.
+static void drawProfilerOverlay(sf::RenderWindow& window, const OverlayText& text) {
+    sf::FloatRect bounds = text.getGlobalBounds();
+    sf::RectangleShape backdrop(sf::Vector2f(bounds.left + bounds.width + 8.f, bounds.top + bounds.height + 8.f));
+    backdrop.setFillColor(sf::Color(0, 0, 0, 160));
+    window.draw(backdrop);
+    window.draw(text);
+}
+
+// Draws a bar along the bottom edge of the window, filled to `fraction`.
+static void drawProgressBar(sf::RenderWindow& window, double fraction, sf::Color color) {
+    sf::Vector2f size = window.getView().getSize();
+    sf::Vector2f corner = window.getView().getCenter() - size / 2.f;
+    sf::RectangleShape track(sf::Vector2f(size.x, 6.f));
+    track.setPosition(corner.x, corner.y + size.y - 6.f);
+    track.setFillColor(sf::Color(0, 0, 0, 160));
+    window.draw(track);
+    sf::RectangleShape bar(sf::Vector2f(size.x * static_cast<float>(fraction), 6.f));
+    bar.setPosition(track.getPosition());
+    bar.setFillColor(color);
+    window.draw(bar);
+}
+
+// Renders a scene file into an image without opening a window. With reference
+// the scene is drawn again by the single-threaded SoftwareRasterizer, and any
+// pixel that differs fails the render.
+static int renderHeadless(const string& source, const string& destination, unsigned width, unsigned height,
+                          bool reference) {
+    Scene scene;
+    string error;
+    if (!loadScene(source, scene, &error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    TiledRasterizer rasterizer(width, height);
+    auto start = chrono::steady_clock::now();
+    rasterizer.clear(sf::Color::Black);
+    for (auto object : scene.objects)
+        object->draw(rasterizer);
+    rasterizer.display();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (!rasterizer.save(destination)) {
+        cerr << "Cannot write " << destination << endl;
+        return 1;
+    }
+    cout << scene.store.size() << " shapes rendered in " << seconds * 1000.0 << " ms on "
+         << rasterizer.getThreadCount() << " threads" << endl;
+    if (reference) {
+        SoftwareRasterizer expected(width, height);
+        expected.clear(sf::Color::Black);
+        for (auto object : scene.objects)
+            object->draw(expected);
+        expected.display();
+        const sf::Uint8* pixels = rasterizer.getPixels();
+        size_t differing = 0;
+        for (size_t i = 0; i < expected.getPixels().size(); i += 4)
+            if (!equal(pixels + i, pixels + i + 4, expected.getPixels().begin() + i))
+                differing++;
+        if (differing) {
+            cerr << differing << " pixels differ from the reference rasterizer" << endl;
+            return 1;
         }
+        cout << "Matches the reference rasterizer" << endl;
     }
-
-    void save(ofstream& file) {
-        file << "Aggregate" << endl;
-        file << objects.size() << endl;
-        for (auto object : objects) {
-            object->save(file);
+    return 0;
+}
+
+static int badNumber(const string& option, const string& value) {
+    cerr << option << ": '" << value << "' is not a valid number" << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if ((argc == 4 || argc == 5) && string(argv[1]) == "--convert") {
+        float quantum = 0.f;
+        if (argc == 5 && !parseNumber(argv[4], quantum))
+            return badNumber(argv[1], argv[4]);
+        if (!convertScene(argv[2], argv[3], quantum)) {
+            cerr << "Cannot convert " << argv[2] << " to " << argv[3] << endl;
+            return 1;
         }
-    }
-
-    void load(ifstream& file) {
-        int size;
-        file >> size;
-        for (int i = 0; i < size; i++) {
-            string type;
-            file >> type;
-            if (type == "Circle") {
-                Circle* circle = new Circle();
-                circle->load(file);
-                objects.push_back(circle);
-            }
-            else if (type == "Rectangle") {
-                Rectangle* rectangle = new Rectangle();
-                rectangle->load(file);
-                objects.push_back(rectangle);
-            }
-            else if (type == "Triangle") {
-                Triangle* triangle = new Triangle();
-                triangle->load(file);
-                objects.push_back(triangle);
-            }
-            else if (type == "Aggregate") {
-                Aggregate* aggregate = new Aggregate();
-                aggregate->load(file);
-                objects.push_back(aggregate);
-            }
+        return 0;
+    }
+    if (argc == 3 && string(argv[1]) == "--bench-load")
+        return benchmarkTextLoad(argv[2]);
+    if ((argc == 3 || argc == 4) && string(argv[1]) == "--replay")
+        return replayScript(argv[2], argc == 4 ? argv[3] : "");
+    if (argc >= 4 && argc <= 7 && string(argv[1]) == "--render") {
+        // --render scene image [width height] [--reference]
+        bool reference = string(argv[argc - 1]) == "--reference";
+        int count = reference ? argc - 1 : argc;
+        if (count == 4 || count == 6) {
+            unsigned width = 800, height = 600;
+            if (count == 6 && !parseNumber(argv[4], width))
+                return badNumber(argv[1], argv[4]);
+            if (count == 6 && !parseNumber(argv[5], height))
+                return badNumber(argv[1], argv[5]);
+            return renderHeadless(argv[2], argv[3], width, height, reference);
         }
     }
 
-    void changeColor(sf::Color color) {
-        for (auto object : objects) {
-            object->changeColor(color);
+    // Frame pacing: a frame cap (0 = none) or vsync. By default frames are
+    // only drawn when something changed and the loop sleeps on input otherwise.
+    unsigned frameLimit = 60;
+    bool vsync = false;
+    bool redrawOnDemand = true;
+    // Base name of the autosave files; empty turns autosave off.
+    string autosave = "autosave";
+    // Commands per frame from a simulated external producer; 0 = none.
+    unsigned simulationRate = 0;
+    string recordFile;
+    // Font file to try before the usual places.
+    string fontFile;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--fps" && i + 1 < argc) {
+            if (!parseNumber(argv[++i], frameLimit))
+                return badNumber(option, argv[i]);
         }
-    }
-
-    void changeSize(float size) {
-        for (auto object : objects) {
-            object->changeSize(size);
+        else if (option == "--vsync")
+            vsync = true;
+        else if (option == "--continuous")
+            redrawOnDemand = false;
+        else if (option == "--autosave" && i + 1 < argc)
+            autosave = argv[++i];
+        else if (option == "--no-autosave")
+            autosave.clear();
+        else if (option == "--simulate" && i + 1 < argc) {
+            if (!parseNumber(argv[++i], simulationRate))
+                return badNumber(option, argv[i]);
         }
+        else if (option == "--record" && i + 1 < argc)
+            recordFile = argv[++i];
+        else if (option == "--font" && i + 1 < argc)
+            fontFile = argv[++i];
     }
 
-    void setVisible(bool visible) {
-        this->visible = visible;
-        for (auto object : objects) {
-            object->setVisible(visible);
+    sf::RenderWindow window(sf::VideoMode(800, 600), "Graphic shapes");
+    if (vsync)
+        window.setVerticalSyncEnabled(true);
+    else
+        window.setFramerateLimit(frameLimit);
+
+    unique_ptr<Scene> scene(new Scene());
+    DrawOrder order;
+    SpatialGrid grid;
+    SceneRenderer renderer;
+    scene->store.setChangeTracking(true);
+
+    FrameProfiler profiler;
+    bool showStats = false;
+    // Fonts are loaded on first use and kept; the dialogs are drawn inside
+    // the window with them.
+    FontCache fonts;
+    if (!fontFile.empty())
+        fonts.preferFile(fontFile);
+    OverlayText statsText(fonts, 12);
+    statsText.setPosition(4.f, 4.f);
+    OverlayDialog dialog(fonts);
+    // Whether the open prompt is for a save or a load.
+    bool promptSaves = false;
+    // Trails are not left behind by a dialog.
+    bool dialogDrawn = false;
+    sf::Clock statsClock;
+
+    bool needsRedraw = true;
+    unsigned drawnVersion = 0;
+
+    // The save or load running in the background, if any; one at a time.
+    unique_ptr<SceneFileTask> fileTask;
+
+    // Every edit made from the keyboard, for Ctrl+Z and Ctrl+Y.
+    UndoHistory history;
+
+    // Edits are also appended to the autosave journal, from which the scene
+    // of the last session is recovered here.
+    SceneJournal journal(autosave);
+    if (!autosave.empty()) {
+        string error;
+        if (!journal.recover(*scene, &error))
+            cerr << error << endl;
+        history.setJournal(&journal);
+    }
+
+    // Edits from other threads, applied once per frame.
+    SceneCommandQueue commands;
+    atomic<bool> stopSimulation(false);
+    thread simulation;
+    if (simulationRate)
+        simulation = thread(runSimulation, ref(commands), cref(stopSimulation), simulationRate);
+
+    // The editing keys and the selection, shared with --replay.
+    SceneEditor editor(scene, history);
+    auto onSceneReplaced = [&] {
+        commands.forgetObjects();
+        scene->store.setChangeTracking(true);
+        order.invalidate();
+        renderer.reset();
+    };
+
+    // With --record every edit is written out as a --replay script line. A
+    // replay starts from an empty scene, so a recovered scene is saved next
+    // to the script and loaded by its first line.
+    ofstream recording;
+    if (!recordFile.empty()) {
+        recording.open(recordFile);
+        if (!recording.is_open())
+            cerr << "Cannot write " << recordFile << endl;
+        else if (!scene->objects.empty()) {
+            string start = recordFile + ".start" + binarySceneExtension;
+            if (saveScene(start, *scene))
+                recording << "Load " << start << "\n";
+            else
+                cerr << "Cannot write " << start << endl;
         }
     }
 
-    bool isVisible() override {
-        return visible;
-    }
-};
-
-int main() {
-    sf::RenderWindow window(sf::VideoMode(800, 600), "Graphic shapes");
-
-    vector<GraphicObject*> objects;
-
-    int currentObject = 0;
     bool trail = false;
-    float scaleIncrement = 0.1f; 
-    float currentScale = 1.0f;   
 
     while (window.isOpen()) {
+        // Input: drain every pending event. With nothing to draw there is no
+        // point in spinning, so block until the next one arrives.
         sf::Event event;
-        while (window.pollEvent(event)) {
+        bool pending;
+        if (redrawOnDemand && !needsRedraw && !showStats && !fileTask && !simulationRate)
+            pending = window.waitEvent(event);
+        else
+            pending = window.pollEvent(event);
+        profiler.beginFrame();
+        ScopedTimer eventsTimer(profiler, "events");
+        for (; pending; pending = window.pollEvent(event)) {
             if (event.type == sf::Event::Closed) {  
                 window.close();
                 break; 
             }
+            // An open dialog takes the keyboard and the mouse buttons.
+            OverlayDialog::Result dialogResult = dialog.handleEvent(event);
+            if (dialogResult != OverlayDialog::Result::Ignored) {
+                const string& filename = dialog.getInput();
+                if (dialogResult == OverlayDialog::Result::Submitted && !filename.empty()) {
+                    if (fileTask) {
+                        cerr << "Wait for " << fileTask->getFilename() << " to finish" << endl;
+                    }
+                    else if (promptSaves) {
+                        ScopedTimer timer(profiler, "snapshot");
+                        fileTask = SceneFileTask::save(filename, *scene);
+                        if (recording.is_open())
+                            recording << "Save " << filename << "\n";
+                    }
+                    else {
+                        fileTask = SceneFileTask::load(filename);
+                    }
+                }
+                needsRedraw = true;
+                continue;
+            }
+            if (event.type == sf::Event::Resized || event.type == sf::Event::GainedFocus)
+                needsRedraw = true;
             else if (event.type == sf::Event::KeyPressed) {
+                // Escape cancels a running save or load before it closes the window.
                 if (event.key.code == sf::Keyboard::Escape) {
-                    window.close();
+                    if (fileTask)
+                        fileTask->cancel();
+                    else
+                        window.close();
                 }
             }
+            if (event.type == sf::Event::MouseButtonPressed && event.mouseButton.button == sf::Mouse::Left) {
+                sf::Vector2f point = window.mapPixelToCoords(sf::Vector2i(event.mouseButton.x, event.mouseButton.y));
+                editor.click(order, grid, point.x, point.y);
+                if (recording.is_open())
+                    recording << "Click " << point.x << " " << point.y << "\n";
+            }
             if (event.type == sf::Event::KeyPressed) {
                 if (event.key.code == sf::Keyboard::F1) {
-                    sf::RenderWindow commandsWindow(sf::VideoMode(400, 300), "Help");
-                    sf::Font font;
-                    if (!font.loadFromFile("D:/Font_arial/arial.ttf")) {}
-
-                    sf::Text text;
-                    text.setFont(font);
-                    text.setCharacterSize(14);
-
-                    sf::Color textColor(17, 59, 8);
-                    text.setFillColor(textColor);
-
-                    text.setPosition(0, 0);
-
-                    text.setString("Commands:\n"
-                        "C - create circle\n"
-                        "R - create rectangle\n"
-                        "T - create triangle\n"
-                        "A - create aggregate\n"
-                        "Tab - switch between objects\n"
-                        "Up/Down/Left/Right - move object\n"
-                        "E - toggle trail\n"
-                        "S - save state to file\n"
-                        "L - load state from file\n"
-                        "1 - change color to red\n"
-                        "2 - change color to green\n"
-                        "3 - change color to blue\n"
-                        "+ - increase size\n"
-                        "- - decrease size\n"
-                        "V - toggle visibility");
-
-                    while (commandsWindow.isOpen()) {
-                        sf::Event event;
-                        while (commandsWindow.pollEvent(event)) {
-                            if (event.type == sf::Event::Closed) {
-                                commandsWindow.close();
-                            }
-                            else if (event.type == sf::Event::KeyPressed) {
-                                if (event.key.code == sf::Keyboard::Escape) {
-                                    commandsWindow.close();
-                                }
-                            }
-                        }
-                        commandsWindow.clear(sf::Color::Black);
-                        commandsWindow.draw(text);
-                        commandsWindow.display();
-                    }
-                }
-                if (event.key.code == sf::Keyboard::C) {
-                    objects.push_back(new Circle());
-                    currentObject = objects.size() - 1;
-                }
-                if (event.key.code == sf::Keyboard::R) {
-                    objects.push_back(new Rectangle());
-                    currentObject = objects.size() - 1;
+                    dialog.openHelp(helpText);
+                    needsRedraw = true;
+                    continue;
                 }
-                if (event.key.code == sf::Keyboard::T) {
-                    objects.push_back(new Triangle());
-                    currentObject = objects.size() - 1;
-                }
-                if (event.key.code == sf::Keyboard::A) {
-                    objects.push_back(new Aggregate());
-                    currentObject = objects.size() - 1;
+                SceneEditor::Result result = editor.handleKey(event.key.code, event.key.control, event.key.shift);
+                if (result != SceneEditor::Result::Ignored) {
+                    if (result == SceneEditor::Result::SceneReplaced)
+                        onSceneReplaced();
+                    if (recording.is_open())
+                        recording << replayKeyLine(event.key.code, event.key.control, event.key.shift) << "\n";
+                    needsRedraw = true;
+                    continue;
                 }
                 if (event.type == sf::Event::KeyPressed) {
-                    if (event.key.code == sf::Keyboard::Tab) {
-                        currentObject++;
-                        if (currentObject >= objects.size())
-                            currentObject = 0;
-                    }
-                    if (event.key.code == sf::Keyboard::Up) {
-                        if (!objects.empty())
-                            objects[currentObject]->move(0, -10);
-                    }
-                    if (event.key.code == sf::Keyboard::Down) {
-                        if (!objects.empty())
-                            objects[currentObject]->move(0, 10);
-                    }
-                    if (event.key.code == sf::Keyboard::Left) {
-                        if (!objects.empty())
-                            objects[currentObject]->move(-10, 0);
-                    }
-                    if (event.key.code == sf::Keyboard::Right) {
-                        if (!objects.empty())
-                            objects[currentObject]->move(10, 0);
-                    }
                     if (event.key.code == sf::Keyboard::E) {
                         trail = !trail;
+                        needsRedraw = true;
                     }
-                    if (event.key.code == sf::Keyboard::S) {
-                        sf::RenderWindow saveWindow(sf::VideoMode(400, 100), "Save File");
-
-                        sf::Font font;
-                        if (!font.loadFromFile("D:/Font_arial/arial.ttf")) {}
-
-                        sf::Text text;
-                        text.setFont(font);
-                        text.setCharacterSize(14);
-                        text.setString("Enter filename:");
-                        text.setPosition(10, 10);
-
-                        sf::RectangleShape inputBox(sf::Vector2f(380, 30));
-                        inputBox.setFillColor(sf::Color::White);
-                        inputBox.setPosition(10, 50);
-
-                        sf::Text inputText;
-                        inputText.setFont(font);
-                        inputText.setCharacterSize(14);
-                        inputText.setFillColor(sf::Color::Black);
-                        inputText.setPosition(15, 55);
-
-                        string filename;
-
-                        while (saveWindow.isOpen()) {
-                            sf::Event saveEvent;
-                            while (saveWindow.pollEvent(saveEvent)) {
-                                if (saveEvent.type == sf::Event::Closed) {
-                                    saveWindow.close();
-                                }
-                                else if (saveEvent.type == sf::Event::TextEntered) {
-                                    if (saveEvent.text.unicode == 13) {
-                                        ofstream file(filename);
-                                        file << objects.size() << endl;
-                                        for (auto object : objects)
-                                            object->save(file);
-                                        file.close();
-                                        saveWindow.close();
-                                    }
-                                    else if (saveEvent.text.unicode == 8 && !filename.empty()) { 
-                                        filename.pop_back();
-                                        inputText.setString(filename);
-                                    }
-                                    else if (saveEvent.text.unicode < 128) {
-                                        filename += static_cast<char>(saveEvent.text.unicode);
-                                        inputText.setString(filename);
-                                    }
-                                }
-                            }
-                            saveWindow.clear(sf::Color::Black);
-                            saveWindow.draw(text);
-                            saveWindow.draw(inputBox);
-                            saveWindow.draw(inputText);
-                            saveWindow.display();
-                        }
+                    if (event.key.code == sf::Keyboard::F2) {
+                        showStats = !showStats;
+                        needsRedraw = true;
+                        if (!showStats)
+                            window.setTitle("Graphic shapes");
                     }
-                    if (event.key.code == sf::Keyboard::L) {
-                        sf::RenderWindow loadWindow(sf::VideoMode(400, 100), "Load File");
-
-                        sf::Font font;
-                        if (!font.loadFromFile("D:/Font_arial/arial.ttf")) {}
-
-                        sf::Text text;
-                        text.setFont(font);
-                        text.setCharacterSize(14);
-                        text.setString("Enter filename:");
-                        text.setPosition(10, 10);
-
-                        sf::RectangleShape inputBox(sf::Vector2f(380, 30));
-                        inputBox.setFillColor(sf::Color::White);
-                        inputBox.setPosition(10, 50);
-
-                        sf::Text inputText;
-                        inputText.setFont(font);
-                        inputText.setCharacterSize(14);
-                        inputText.setFillColor(sf::Color::Black);
-                        inputText.setPosition(15, 55);
-
-                        string filename;
-
-                        while (loadWindow.isOpen()) {
-                            sf::Event loadEvent;
-                            while (loadWindow.pollEvent(loadEvent)) {
-                                if (loadEvent.type == sf::Event::Closed) {
-                                    loadWindow.close();
-                                }
-                                else if (loadEvent.type == sf::Event::TextEntered) {
-                                    if (loadEvent.text.unicode == 13) {
-                                        ifstream file(filename);
-                                        if (file.is_open()) {
-                                            int size;
-                                            file >> size;
-                                            for (int i = 0; i < size; i++) {
-                                                string type;
-                                                file >> type;
-                                                if (type == "Circle") {
-                                                    Circle* circle = new Circle();
-                                                    circle->load(file);
-                                                    objects.push_back(circle);
-                                                }
-                                                else if (type == "Rectangle") {
-                                                    Rectangle* rectangle = new Rectangle();
-                                                    rectangle->load(file);
-                                                    objects.push_back(rectangle);
-                                                }
-                                                else if (type == "Aggregate") {
-                                                    Aggregate* aggregate = new Aggregate();
-                                                    aggregate->load(file);
-                                                    objects.push_back(aggregate);
-                                                }
-                                            }
-                                            file.close();
-                                        }
-                                        loadWindow.close();
-                                    }
-                                    else if (loadEvent.text.unicode == 8 && !filename.empty()) {
-                                        filename.pop_back();
-                                        inputText.setString(filename);
-                                    }
-                                    else if (loadEvent.text.unicode < 128) {
-                                        filename += static_cast<char>(loadEvent.text.unicode);
-                                        inputText.setString(filename);
-                                    }
-                                }
-                            }
-                            loadWindow.clear(sf::Color::Black);
-                            loadWindow.draw(text);
-                            loadWindow.draw(inputBox);
-                            loadWindow.draw(inputText);
-                            loadWindow.display();
-                        }
-                    }
-                    if (event.key.code == sf::Keyboard::Num1) {
-                        if (!objects.empty())
-                            objects[currentObject]->changeColor(sf::Color::Red);
+                    if (event.key.code == sf::Keyboard::F3) {
+                        if (profiler.writeTrace("trace.json"))
+                            cout << "Trace written to trace.json" << endl;
+                        else
+                            cerr << "Cannot write trace.json" << endl;
                     }
-                    if (event.key.code == sf::Keyboard::Num2) {
-                        if (!objects.empty())
-                            objects[currentObject]->changeColor(sf::Color::Green);
-                    }
-                    if (event.key.code == sf::Keyboard::Num3) {
-                        if (!objects.empty())
-                            objects[currentObject]->changeColor(sf::Color::Blue);
-                    }
-                    if (event.key.code == sf::Keyboard::Add) { 
-                        if (!objects.empty()) {
-                            currentScale += scaleIncrement; 
-                            objects[currentObject]->changeSize(currentScale);
-                        }
-                    }
-                    if (event.key.code == sf::Keyboard::Subtract) { 
-                        if (!objects.empty()) {
-                            currentScale -= scaleIncrement; 
-                            if (currentScale < 0.1f) { 
-                                currentScale = 0.1f;
-                            }
-                            objects[currentObject]->changeSize(currentScale);
-                        }
+                    if (event.key.code == sf::Keyboard::S) {
+                        promptSaves = true;
+                        dialog.openPrompt("Save scene to file:");
+                        needsRedraw = true;
                     }
-                    if (event.key.code == sf::Keyboard::V) {
-                        if (!objects.empty()) {
-                            bool currentVisibility = objects[currentObject]->isVisible();
-                            objects[currentObject]->setVisible(!currentVisibility);
-                        }
+                    if (event.key.code == sf::Keyboard::L) {
+                        promptSaves = false;
+                        dialog.openPrompt("Load scene from file:");
+                        needsRedraw = true;
                     }
                 }
             }
-            if (!trail)
+        }
+        eventsTimer.stop();
+        if (!window.isOpen())
+            break;
+
+        // A finished load replaces the scene in one step, between frames.
+        if (fileTask && fileTask->isFinished()) {
+            unique_ptr<Scene> loaded = fileTask->takeScene();
+            if (loaded) {
+                editor.replaceScene(move(loaded));
+                onSceneReplaced();
+                if (recording.is_open())
+                    recording << "Load " << fileTask->getFilename() << "\n";
+            }
+            else if (!fileTask->hasSucceeded()) {
+                cerr << fileTask->getError() << endl;
+            }
+            fileTask.reset();
+            needsRedraw = true;
+        }
+
+        {
+            ScopedTimer timer(profiler, "commands");
+            commands.drain(*scene, history);
+        }
+        if (!autosave.empty()) {
+            ScopedTimer timer(profiler, "autosave");
+            journal.update(*scene);
+        }
+
+        // Update: bring the draw order and spatial index in line with the scene.
+        {
+            ScopedTimer timer(profiler, "index");
+            order.update(scene->store, scene->objects);
+            grid.update(scene->store);
+        }
+        if (scene->store.getVersion() != drawnVersion)
+            needsRedraw = true;
+        // A frame that draws nothing still counts, so its events, commands
+        // and index time reach the phase stats.
+        if (redrawOnDemand && !needsRedraw && !showStats && !fileTask && !simulationRate) {
+            profiler.endFrame();
+            continue;
+        }
+
+        // Render; display() waits out the frame cap or vsync.
+        {
+            ScopedTimer timer(profiler, "clear");
+            if (!trail || dialogDrawn)
                 window.clear();
-            for (auto object : objects)
-                object->draw(window);
+        }
+        {
+            ScopedTimer timer(profiler, "draw");
+            renderer.draw(window, scene->store, order, &grid);
+        }
+        if (showStats) {
+            if (statsClock.getElapsedTime() >= sf::milliseconds(250)) {
+                string summary = profiler.summary();
+                statsText.setString(summary);
+                statsClock.restart();
+            }
+            drawProfilerOverlay(window, statsText);
+        }
+        if (fileTask)
+            drawProgressBar(window, fileTask->getProgress(), fileTask->isLoading() ? sf::Color(80, 160, 255) : sf::Color(80, 220, 120));
+        dialog.draw(window);
+        dialogDrawn = dialog.isOpen();
+        {
+            ScopedTimer timer(profiler, "display");
             window.display();
         }
+        profiler.endFrame();
+        needsRedraw = false;
+        drawnVersion = scene->store.getVersion();
     }
+    stopSimulation = true;
+    if (simulation.joinable())
+        simulation.join();
     return 0;
-}
\ No newline at end of file
+}
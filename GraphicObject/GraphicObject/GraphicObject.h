@@ -0,0 +1,479 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <fstream>
+#include <memory_resource>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BinaryScene.h"
+#include "RenderBackend.h"
+#include "SceneArena.h"
+#include "ShapeFormat.h"
+#include "ShapeStore.h"
+#include "TaskScheduler.h"
+
+using namespace std;
+
+// What move and changeSize can change about an object: the geometry of a
+// leaf (local to its group) or the transform of an Aggregate's group.
+struct ObjectPlacement {
+    GroupTransform transform;
+    float x = 0.f;
+    float y = 0.f;
+    float width = 0.f;
+    float height = 0.f;
+    sf::Vector2f points[3];
+};
+
+class GraphicObject {
+public:
+    virtual ~GraphicObject() {}
+
+    virtual void draw(RenderBackend& backend) = 0;
+    virtual void move(float x, float y) = 0;
+    virtual void save(ostream& file) = 0;
+    virtual void load(ifstream& file) = 0;
+    virtual void changeColor(sf::Color color) = 0;
+    virtual void changeSize(float size) = 0;
+    virtual void setVisible(bool visible) = 0;
+    virtual bool isVisible() = 0;
+
+    // Collects the store handles of the drawable leaves in draw order.
+    virtual void collectHandles(vector<ShapeHandle>& handles) = 0;
+    // Adds the object's records to a binary scene and returns its node reference.
+    virtual uint32_t saveBinary(BinarySceneWriter& writer) = 0;
+    // Puts the object under a store transform group, keeping it where it is on screen.
+    virtual void attach(unsigned group) = 0;
+    // Reads or puts back the object's placement, e.g. to undo a move or resize.
+    virtual ObjectPlacement getPlacement() = 0;
+    virtual void setPlacement(const ObjectPlacement& placement) = 0;
+};
+
+// Writes objects one after another in the text format. In large scenes the
+// objects are split into consecutive runs that are formatted into separate
+// buffers on the shared TaskScheduler and then written out in order, so the
+// file is the same as a serial save. Only the outermost call goes parallel;
+// saves nested inside a run stay on that run's thread.
+template <typename Objects>
+void saveObjects(ostream& file, const Objects& objects, const ShapeStore& store) {
+    static thread_local bool inParallelSave = false;
+    TaskScheduler& scheduler = TaskScheduler::shared();
+    size_t count = objects.size();
+    if (inParallelSave || count < 2 || store.size() < ShapeStore::parallelGrain || scheduler.getThreadCount() < 2) {
+        for (auto object : objects)
+            object->save(file);
+        return;
+    }
+    // Readers on several threads must find every world transform resolved.
+    store.resolveTransforms();
+    // Formats a few runs per thread at a time, so the buffers stay a fraction of the file.
+    size_t runs = min(count, static_cast<size_t>(scheduler.getThreadCount()) * 4);
+    vector<string> buffers(runs);
+    for (size_t begin = 0; begin < count; ) {
+        size_t end = min(count, begin + max<size_t>(ShapeStore::parallelGrain, count / 8));
+        scheduler.parallelFor(0, runs, 1, [&](size_t firstRun, size_t lastRun) {
+            bool outer = inParallelSave;
+            inParallelSave = true;
+            for (size_t run = firstRun; run < lastRun; run++) {
+                ostringstream buffer;
+                for (size_t i = begin + (end - begin) * run / runs; i < begin + (end - begin) * (run + 1) / runs; i++)
+                    objects[i]->save(buffer);
+                buffers[run] = buffer.str();
+            }
+            inParallelSave = outer;
+        });
+        for (auto& buffer : buffers)
+            file.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+        begin = end;
+    }
+}
+
+// A leaf shape whose data lives in a ShapeStore; the object itself only keeps the handle.
+class StoredShape : public GraphicObject {
+protected:
+    ShapeStore& store;
+    ShapeHandle handle;
+
+    StoredShape(ShapeStore& store, ShapeType type) : store(store) {
+        handle = store.create(type);
+    }
+
+    ~StoredShape() {
+        store.destroy(handle);
+    }
+
+    StoredShape(const StoredShape&) = delete;
+    StoredShape& operator=(const StoredShape&) = delete;
+
+    unsigned index() const {
+        return store.indexOf(handle);
+    }
+
+public:
+    ShapeHandle getHandle() const {
+        return handle;
+    }
+
+    void draw(RenderBackend& backend) override {
+        backend.drawShape(store, index());
+    }
+
+    void collectHandles(vector<ShapeHandle>& handles) override {
+        handles.push_back(handle);
+    }
+
+    void attach(unsigned group) override {
+        store.setGroup(index(), group);
+    }
+
+    ObjectPlacement getPlacement() override {
+        unsigned i = index();
+        ObjectPlacement placement;
+        placement.x = store.x[i];
+        placement.y = store.y[i];
+        placement.width = store.width[i];
+        placement.height = store.height[i];
+        copy(&store.points[i * 3], &store.points[i * 3] + 3, placement.points);
+        return placement;
+    }
+
+    void setPlacement(const ObjectPlacement& placement) override {
+        unsigned i = index();
+        store.x[i] = placement.x;
+        store.y[i] = placement.y;
+        store.width[i] = placement.width;
+        store.height[i] = placement.height;
+        copy(placement.points, placement.points + 3, &store.points[i * 3]);
+        store.revision[i]++;
+        store.markChanged(i, i + 1);
+    }
+
+    // Moves by (x, y) on screen, whatever the scale of the enclosing groups.
+    void move(float x, float y) override {
+        unsigned i = index();
+        float scale = store.worldTransform(store.group[i]).scale;
+        if (scale != 0.f)
+            store.moveRange(i, i + 1, x / scale, y / scale);
+    }
+
+    void changeColor(sf::Color color) override {
+        unsigned i = index();
+        store.changeColorRange(i, i + 1, color);
+    }
+
+    void changeSize(float size) override {
+        unsigned i = index();
+        store.changeSizeRange(i, i + 1, size);
+    }
+
+    void setVisible(bool visible) override {
+        unsigned i = index();
+        store.setVisibleRange(i, i + 1, visible);
+    }
+
+    bool isVisible() override {
+        return store.visible[index()] != 0;
+    }
+};
+
+// A leaf shape whose file formats are generated from ShapeFormat<Derived>.
+// Derived only converts between the store columns and the format's values:
+// getValues(values) in world coordinates and setValues(values, color).
+template <typename Derived>
+class FormattedShape : public StoredShape {
+protected:
+    using Format = ShapeFormat<Derived>;
+
+    FormattedShape(ShapeStore& store) : StoredShape(store, Format::type) {}
+
+public:
+    // Files hold world coordinates; Aggregate transforms are baked in.
+    void save(ostream& file) override {
+        float values[Format::valueCount];
+        static_cast<Derived*>(this)->getValues(values);
+        writeShapeText<Derived>(file, values, store.getFillColor(index()).toInteger());
+    }
+
+    uint32_t saveBinary(BinarySceneWriter& writer) override {
+        float values[Format::valueCount];
+        static_cast<Derived*>(this)->getValues(values);
+        return writer.add(makeShapeRecord<Derived>(values, store.getFillColor(index()).toInteger()));
+    }
+
+    void load(ifstream& file) override {
+        float values[Format::valueCount];
+        sf::Uint32 color;
+        for (auto& value : values)
+            file >> value;
+        file >> color;
+        static_cast<Derived*>(this)->setValues(values, color);
+    }
+};
+
+class Circle : public FormattedShape<Circle> {
+public:
+    Circle(ShapeStore& store, float radius = 10.f) : FormattedShape(store) {
+        unsigned i = index();
+        store.width[i] = radius;
+        store.height[i] = radius;
+        store.x[i] = 100.f;
+        store.y[i] = 100.f;
+    }
+
+    void getValues(float* values) const {
+        ShapeGeometry shape = store.getGeometry(index());
+        values[0] = shape.x;
+        values[1] = shape.y;
+        values[2] = shape.width;
+    }
+
+    void setValues(const float* values, sf::Uint32 color) {
+        set(values[0], values[1], values[2], color);
+    }
+
+    void set(float x, float y, float radius, sf::Uint32 color) {
+        unsigned i = index();
+        store.x[i] = x;
+        store.y[i] = y;
+        store.width[i] = radius;
+        store.height[i] = radius;
+        store.color[i] = color;
+        store.visible[i] = 1;
+        store.revision[i]++;
+        store.markChanged(i, i + 1);
+    }
+};
+
+class Rectangle : public FormattedShape<Rectangle> {
+public:
+    Rectangle(ShapeStore& store, float width = 20.f, float height = 30.f) : FormattedShape(store) {
+        unsigned i = index();
+        store.width[i] = width;
+        store.height[i] = height;
+        store.x[i] = 200.f;
+        store.y[i] = 100.f;
+    }
+
+    void getValues(float* values) const {
+        ShapeGeometry shape = store.getGeometry(index());
+        values[0] = shape.x;
+        values[1] = shape.y;
+        values[2] = shape.width;
+        values[3] = shape.height;
+    }
+
+    void setValues(const float* values, sf::Uint32 color) {
+        set(values[0], values[1], values[2], values[3], color);
+    }
+
+    void set(float x, float y, float width, float height, sf::Uint32 color) {
+        unsigned i = index();
+        store.x[i] = x;
+        store.y[i] = y;
+        store.width[i] = width;
+        store.height[i] = height;
+        store.color[i] = color;
+        store.visible[i] = 1;
+        store.revision[i]++;
+        store.markChanged(i, i + 1);
+    }
+};
+
+class Triangle : public FormattedShape<Triangle> {
+public:
+    Triangle(ShapeStore& store, float size = 20.f) : FormattedShape(store) {
+        unsigned i = index();
+        sf::Vector2f* p = &store.points[i * 3];
+        p[0] = sf::Vector2f(0.f, -size);
+        p[1] = sf::Vector2f(size * sqrt(3.f) / 2, size / 2);
+        p[2] = sf::Vector2f(-size * sqrt(3.f) / 2, size / 2);
+        store.x[i] = 300.f;
+        store.y[i] = 100.f;
+    }
+
+    void getValues(float* values) const {
+        ShapeGeometry shape = store.getGeometry(index());
+        values[0] = shape.x;
+        values[1] = shape.y;
+        for (int k = 0; k < 3; k++) {
+            values[2 + k * 2] = shape.points[k].x;
+            values[3 + k * 2] = shape.points[k].y;
+        }
+    }
+
+    void setValues(const float* values, sf::Uint32 color) {
+        sf::Vector2f points[3] = { sf::Vector2f(values[2], values[3]), sf::Vector2f(values[4], values[5]), sf::Vector2f(values[6], values[7]) };
+        set(values[0], values[1], points, color);
+    }
+
+    void set(float x, float y, const sf::Vector2f* points, sf::Uint32 color) {
+        unsigned i = index();
+        sf::Vector2f* p = &store.points[i * 3];
+        store.x[i] = x;
+        store.y[i] = y;
+        p[0] = points[0];
+        p[1] = points[1];
+        p[2] = points[2];
+        store.color[i] = color;
+        store.visible[i] = 1;
+        store.revision[i]++;
+        store.markChanged(i, i + 1);
+    }
+};
+
+// Owns its children. Children and the Aggregate's own vectors live in the
+// scene arena, so dropping the arena needs no destructor calls; destroying a
+// single Aggregate destroys its subtree.
+// Children are placed in the Aggregate's transform group in the store, so
+// move and changeSize only update the group's translation and scale.
+class Aggregate : public GraphicObject {
+private:
+    ShapeStore& store;
+    SceneArena& arena;
+    pmr::vector<GraphicObject*> objects;
+    bool visible;
+    unsigned group;
+
+    // Sorted dense indices of every leaf in this subtree, rebuilt when the store
+    // structure changes, so bulk operations are linear sweeps over the columns.
+    pmr::vector<unsigned> leafIndices;
+    unsigned cachedStructure;
+    bool cacheValid;
+
+    const pmr::vector<unsigned>& leaves() {
+        if (!cacheValid || cachedStructure != store.getStructureVersion()) {
+            vector<ShapeHandle> handles;
+            collectHandles(handles);
+            leafIndices.clear();
+            for (auto handle : handles)
+                leafIndices.push_back(store.indexOf(handle));
+            sort(leafIndices.begin(), leafIndices.end());
+            cachedStructure = store.getStructureVersion();
+            cacheValid = true;
+        }
+        return leafIndices;
+    }
+
+public:
+    Aggregate(ShapeStore& store, SceneArena& arena) : store(store), arena(arena), objects(arena.getResource()),
+        visible(true), group(store.createGroup()), leafIndices(arena.getResource()), cachedStructure(0), cacheValid(false) {}
+
+    ~Aggregate() {
+        for (auto object : objects)
+            arena.destroy(object);
+        store.destroyGroup(group);
+        store.touchStructure();
+    }
+
+    Aggregate(const Aggregate&) = delete;
+    Aggregate& operator=(const Aggregate&) = delete;
+
+    // Takes ownership of an object created in the same arena.
+    void addObject(GraphicObject* object) {
+        object->attach(group);
+        objects.push_back(object);
+        store.touchStructure();
+    }
+
+    const pmr::vector<GraphicObject*>& getObjects() const {
+        return objects;
+    }
+
+    void draw(RenderBackend& backend) {
+        for (auto object : objects) {
+            object->draw(backend);
+        }
+    }
+
+    void collectHandles(vector<ShapeHandle>& handles) override {
+        for (auto object : objects) {
+            object->collectHandles(handles);
+        }
+    }
+
+    void attach(unsigned parent) override {
+        store.setGroupParent(group, parent);
+    }
+
+    ObjectPlacement getPlacement() override {
+        ObjectPlacement placement;
+        placement.transform = store.getGroupTransform(group);
+        return placement;
+    }
+
+    void setPlacement(const ObjectPlacement& placement) override {
+        store.setGroupTransform(group, placement.transform, leaves());
+    }
+
+    void move(float x, float y) {
+        store.moveGroup(group, x, y, leaves());
+    }
+
+    void save(ostream& file) {
+        file << "Aggregate\n";
+        file << objects.size() << "\n";
+        saveObjects(file, objects, store);
+    }
+
+    uint32_t saveBinary(BinarySceneWriter& writer) override {
+        vector<uint32_t> children;
+        for (auto object : objects) {
+            children.push_back(object->saveBinary(writer));
+        }
+        return writer.addAggregate(children);
+    }
+
+    void load(ifstream& file) {
+        int size;
+        file >> size;
+        for (int i = 0; i < size; i++) {
+            string type;
+            file >> type;
+            GraphicObject* object = nullptr;
+            LeafShapes::visitTag(type, [&](auto shape) {
+                object = arena.create<typename decltype(shape)::type>(store);
+            });
+            if (!object && type == "Aggregate")
+                object = arena.create<Aggregate>(store, arena);
+            if (object) {
+                object->load(file);
+                object->attach(group);
+                objects.push_back(object);
+            }
+        }
+        store.touchStructure();
+    }
+
+    void changeColor(sf::Color color) {
+        store.changeColor(leaves(), color);
+    }
+
+    // Sets the scale of the whole group (1 = as the children were added),
+    // keeping the first leaf where it is.
+    void changeSize(float size) {
+        if (size <= 0.f)
+            return;
+        const pmr::vector<unsigned>& indices = leaves();
+        GroupTransform local = store.getGroupTransform(group);
+        sf::Vector2f pivot;
+        if (!indices.empty()) {
+            ShapeGeometry first = store.getGeometry(indices.front());
+            pivot = inverse(store.worldTransform(group)).apply(sf::Vector2f(first.x, first.y));
+        }
+        local.x += pivot.x * (local.scale - size);
+        local.y += pivot.y * (local.scale - size);
+        local.scale = size;
+        store.setGroupTransform(group, local, indices);
+    }
+
+    void setVisible(bool visible) {
+        this->visible = visible;
+        store.setVisible(leaves(), visible);
+    }
+
+    bool isVisible() override {
+        return visible;
+    }
+};
@@ -0,0 +1,355 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "BinaryScene.h"
+#include "DrawOrder.h"
+#include "Scene.h"
+#include "SceneEditor.h"
+#include "SceneFiles.h"
+#include "SpatialGrid.h"
+#include "UndoHistory.h"
+
+using namespace std;
+
+// Replay scripts: one command per line, as the window records them with
+// --record. A command is an editing key, optionally with modifiers, a click
+// in scene coordinates, or a save or load:
+//
+//   C                 Ctrl+Z            Ctrl+Shift+Z
+//   Right x1000       (any command may end in a repeat count)
+//   Click 120 80
+//   Save scene.gob    Load scene.txt
+//
+// Blank lines and lines starting with # are skipped.
+//
+// Only what the user does in the window is recorded. Edits applied by
+// --simulate or other producers through the SceneCommandQueue are not, so a
+// session that had them does not replay to the same scene. A load is
+// recorded when the loaded scene replaces the current one, so loads that
+// failed or were cancelled are left out. A session that began with a
+// recovered autosave scene saves it as <script>.start.gob and loads it
+// first; undoing past that load empties the replayed scene, where the window
+// had nothing left to undo.
+
+struct ReplayKey {
+    const char* name;
+    sf::Keyboard::Key key;
+};
+
+const ReplayKey replayKeys[] = {
+    { "C", sf::Keyboard::C }, { "R", sf::Keyboard::R }, { "T", sf::Keyboard::T }, { "A", sf::Keyboard::A },
+    { "Tab", sf::Keyboard::Tab }, { "Up", sf::Keyboard::Up }, { "Down", sf::Keyboard::Down },
+    { "Left", sf::Keyboard::Left }, { "Right", sf::Keyboard::Right }, { "1", sf::Keyboard::Num1 },
+    { "2", sf::Keyboard::Num2 }, { "3", sf::Keyboard::Num3 }, { "+", sf::Keyboard::Add },
+    { "-", sf::Keyboard::Subtract }, { "V", sf::Keyboard::V }, { "Z", sf::Keyboard::Z }, { "Y", sf::Keyboard::Y }
+};
+
+// The script line for a key; empty for keys scripts have no name for.
+inline string replayKeyLine(sf::Keyboard::Key key, bool control, bool shift) {
+    for (auto& entry : replayKeys)
+        if (entry.key == key)
+            return string(control ? "Ctrl+" : "") + (shift ? "Shift+" : "") + entry.name;
+    return string();
+}
+
+// Distribution of durations with constant memory however many are added:
+// eight buckets per power of two of nanoseconds, so a percentile is within
+// 1/8 of the true value. Minimum, maximum and total are exact.
+class LatencyHistogram {
+private:
+    static const int bucketsPerOctave = 8;
+
+    vector<uint64_t> buckets;
+    uint64_t count;
+    uint64_t minimum;
+    uint64_t maximum;
+    double total;
+
+    static size_t bucketOf(uint64_t nanoseconds) {
+        if (nanoseconds < bucketsPerOctave)
+            return static_cast<size_t>(nanoseconds);
+        int octave = 63;
+        while (!(nanoseconds >> octave))
+            octave--;
+        // The three bits below the leading one pick the bucket within the octave.
+        size_t step = static_cast<size_t>((nanoseconds >> (octave - 3)) & (bucketsPerOctave - 1));
+        return static_cast<size_t>(octave - 2) * bucketsPerOctave + step;
+    }
+
+    // The largest duration falling into a bucket.
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < bucketsPerOctave)
+            return bucket;
+        int octave = static_cast<int>(bucket / bucketsPerOctave) + 2;
+        uint64_t step = bucket % bucketsPerOctave;
+        return ((uint64_t(bucketsPerOctave) + step + 1) << (octave - 3)) - 1;
+    }
+
+public:
+    LatencyHistogram() : buckets(64 * bucketsPerOctave, 0), count(0), minimum(UINT64_MAX), maximum(0), total(0.0) {}
+
+    void add(uint64_t nanoseconds) {
+        buckets[bucketOf(nanoseconds)]++;
+        count++;
+        minimum = min(minimum, nanoseconds);
+        maximum = max(maximum, nanoseconds);
+        total += static_cast<double>(nanoseconds);
+    }
+
+    uint64_t getCount() const {
+        return count;
+    }
+
+    uint64_t getMinimum() const {
+        return count ? minimum : 0;
+    }
+
+    uint64_t getMaximum() const {
+        return maximum;
+    }
+
+    double getTotal() const {
+        return total;
+    }
+
+    // p in [0, 1], in nanoseconds; 0 when empty.
+    uint64_t percentile(double p) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = min(static_cast<uint64_t>(p * count), count - 1);
+        uint64_t seen = 0;
+        for (size_t b = 0; b < buckets.size(); b++) {
+            seen += buckets[b];
+            if (seen > rank)
+                return min(bucketLimit(b), maximum);
+        }
+        return maximum;
+    }
+};
+
+// FNV-1a over the binary records of a scene: equal for scenes that save to
+// the same file, whatever produced them.
+inline uint64_t sceneChecksum(Scene& scene) {
+    BinarySceneWriter snapshot;
+    vector<uint32_t> roots;
+    for (auto object : scene.objects)
+        roots.push_back(object->saveBinary(snapshot));
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t k = 0; k < size; k++)
+            hash = (hash ^ bytes[k]) * 1099511628211ull;
+    };
+    auto mixAll = [&](const auto& records) {
+        uint64_t size = records.size();
+        mix(&size, sizeof(size));
+        if (size)
+            mix(records.data(), records.size() * sizeof(records[0]));
+    };
+    mixAll(snapshot.getRecords<CircleRecord>());
+    mixAll(snapshot.getRecords<RectangleRecord>());
+    mixAll(snapshot.getRecords<TriangleRecord>());
+    mixAll(snapshot.getAggregates());
+    mixAll(snapshot.getChildren());
+    mixAll(roots);
+    return hash;
+}
+
+// Runs a script against a scene of its own, with no window, through the same
+// SceneEditor as the window. Each command is timed together with the update
+// of the draw order and spatial index a frame would make after it, and the
+// times are kept per command name.
+class InputReplay {
+private:
+    struct CommandStats {
+        string name;
+        LatencyHistogram latency;
+    };
+
+    unique_ptr<Scene> scene;
+    UndoHistory history;
+    SceneEditor editor;
+    DrawOrder order;
+    SpatialGrid grid;
+
+    vector<CommandStats> stats;
+    size_t commandCount;
+    double seconds;
+    string error;
+    size_t errorLine;
+
+    LatencyHistogram& statsFor(const string& name) {
+        for (auto& entry : stats)
+            if (entry.name == name)
+                return entry.latency;
+        stats.push_back({ name, LatencyHistogram() });
+        return stats.back().latency;
+    }
+
+    void updateIndex(SceneEditor::Result result) {
+        if (result == SceneEditor::Result::SceneReplaced) {
+            scene->store.setChangeTracking(true);
+            order.invalidate();
+        }
+        if (result == SceneEditor::Result::Changed || result == SceneEditor::Result::SceneReplaced) {
+            order.update(scene->store, scene->objects);
+            grid.update(scene->store);
+        }
+    }
+
+    bool fail(size_t line, const string& message) {
+        error = message;
+        errorLine = line;
+        return false;
+    }
+
+    static bool parseKey(const string& word, sf::Keyboard::Key& key, bool& control, bool& shift) {
+        string rest = word;
+        control = shift = false;
+        for (;;) {
+            if (rest.compare(0, 5, "Ctrl+") == 0 && rest.size() > 5) {
+                control = true;
+                rest.erase(0, 5);
+            }
+            else if (rest.compare(0, 6, "Shift+") == 0 && rest.size() > 6) {
+                shift = true;
+                rest.erase(0, 6);
+            }
+            else {
+                break;
+            }
+        }
+        for (auto& entry : replayKeys) {
+            if (rest == entry.name) {
+                key = entry.key;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    InputReplay() : scene(new Scene()), editor(scene, history), commandCount(0), seconds(0.0), errorLine(0) {
+        scene->store.setChangeTracking(true);
+    }
+
+    // Stops at the first line it cannot run; getError() says why.
+    bool run(const string& filename) {
+        ifstream file(filename);
+        if (!file.is_open())
+            return fail(0, "cannot open " + filename);
+        using Clock = chrono::steady_clock;
+        Clock::time_point started = Clock::now();
+        string line;
+        vector<string> words;
+        for (size_t number = 1; getline(file, line); number++) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            istringstream stream(line);
+            words.clear();
+            for (string word; stream >> word;)
+                words.push_back(word);
+            if (words.empty() || words[0][0] == '#')
+                continue;
+
+            unsigned long long repeat = 1;
+            if (words.size() > 1 && words.back().size() > 1 && words.back()[0] == 'x' &&
+                words.back().find_first_not_of("0123456789", 1) == string::npos) {
+                if (!parseNumber(words.back().substr(1), repeat))
+                    return fail(number, "bad repeat count '" + words.back() + "'");
+                words.pop_back();
+            }
+
+            const string& command = words[0];
+            sf::Keyboard::Key key;
+            bool control, shift;
+            float x = 0.f, y = 0.f;
+            string target;
+            enum { Key, Click, Save, Load } kind;
+            if (command == "Click" && words.size() == 3) {
+                kind = Click;
+                if (!parseNumber(words[1], x) || !parseNumber(words[2], y))
+                    return fail(number, "bad coordinates in '" + line + "'");
+            }
+            else if ((command == "Save" || command == "Load") && words.size() >= 2) {
+                kind = command == "Save" ? Save : Load;
+                target = words[1];
+                for (size_t w = 2; w < words.size(); w++)
+                    target += " " + words[w];
+            }
+            else if (words.size() == 1 && parseKey(command, key, control, shift)) {
+                kind = Key;
+            }
+            else {
+                return fail(number, "unknown command '" + line + "'");
+            }
+
+            LatencyHistogram& latency = statsFor(kind == Key ? command : kind == Click ? "Click" : command);
+            for (unsigned long long k = 0; k < repeat; k++) {
+                Clock::time_point start = Clock::now();
+                SceneEditor::Result result = SceneEditor::Result::Ignored;
+                if (kind == Key) {
+                    result = editor.handleKey(key, control, shift);
+                }
+                else if (kind == Click) {
+                    result = editor.click(order, grid, x, y);
+                }
+                else if (kind == Save) {
+                    if (!saveScene(target, *scene))
+                        return fail(number, "cannot write " + target);
+                }
+                else {
+                    unique_ptr<Scene> loaded(new Scene());
+                    string loadError;
+                    if (!loadScene(target, *loaded, &loadError))
+                        return fail(number, loadError);
+                    result = editor.replaceScene(move(loaded));
+                }
+                updateIndex(result);
+                latency.add(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count()));
+                commandCount++;
+            }
+        }
+        seconds = chrono::duration<double>(Clock::now() - started).count();
+        return true;
+    }
+
+    const string& getError() const {
+        return error;
+    }
+
+    size_t getErrorLine() const {
+        return errorLine;
+    }
+
+    Scene& getScene() {
+        return *scene;
+    }
+
+    // One JSON object per line: one per command name, then the totals with
+    // the checksum of the final scene. Times in microseconds.
+    void writeReport(ostream& out) {
+        for (auto& entry : stats) {
+            const LatencyHistogram& latency = entry.latency;
+            out << "{\"command\":\"" << entry.name << "\",\"count\":" << latency.getCount()
+                << ",\"min_us\":" << latency.getMinimum() / 1000.0 << ",\"p50_us\":" << latency.percentile(0.5) / 1000.0
+                << ",\"p90_us\":" << latency.percentile(0.9) / 1000.0 << ",\"p99_us\":" << latency.percentile(0.99) / 1000.0
+                << ",\"p999_us\":" << latency.percentile(0.999) / 1000.0 << ",\"max_us\":" << latency.getMaximum() / 1000.0
+                << ",\"total_s\":" << latency.getTotal() / 1e9 << "}" << endl;
+        }
+        char checksum[17];
+        snprintf(checksum, sizeof(checksum), "%016llx", static_cast<unsigned long long>(sceneChecksum(*scene)));
+        out << "{\"commands\":" << commandCount << ",\"seconds\":" << seconds << ",\"objects\":" << scene->objects.size()
+            << ",\"shapes\":" << scene->store.size() << ",\"checksum\":\"" << checksum << "\"}" << endl;
+    }
+};
@@ -0,0 +1,167 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <string>
+#include "FontCache.h"
+
+using namespace std;
+
+// The help, save and load dialogs, drawn over the scene inside the main
+// window. They keep their text and shapes between openings and draw with the
+// fonts of a FontCache, so opening one only sets a few strings.
+//
+// While a dialog is open it takes every key, character and mouse button
+// event; the window goes on drawing the scene behind it.
+class OverlayDialog {
+public:
+    enum class Kind {
+        None,
+        Help,       // text, closed with Escape, Enter or F1
+        Prompt      // a title and a line of input, Enter submits
+    };
+
+    // What an event did to the dialog.
+    enum class Result {
+        Ignored,    // not for the dialog; the window handles it
+        Handled,
+        Closed,
+        Submitted   // Enter in a prompt; getInput() has the text
+    };
+
+private:
+    static constexpr float margin = 10.f;
+    static constexpr float promptWidth = 400.f;
+
+    Kind kind;
+    string input;
+    // The key that opened the dialog also sends its character, which is not
+    // part of the input.
+    bool skipText;
+
+    sf::RectangleShape panel;
+    sf::RectangleShape inputBox;
+    OverlayText title;
+    OverlayText inputText;
+
+public:
+    OverlayDialog(FontCache& fonts)
+        : kind(Kind::None), skipText(false), title(fonts, 14), inputText(fonts, 14, sf::Color::Black) {
+        panel.setFillColor(sf::Color(0, 0, 0, 220));
+        panel.setOutlineColor(sf::Color(120, 120, 120));
+        panel.setOutlineThickness(1.f);
+        inputBox.setFillColor(sf::Color::White);
+    }
+
+    void openHelp(const string& text) {
+        kind = Kind::Help;
+        skipText = true;
+        title.setString(text);
+    }
+
+    void openPrompt(const string& text) {
+        kind = Kind::Prompt;
+        skipText = true;
+        input.clear();
+        title.setString(text);
+        inputText.setString(input);
+    }
+
+    void close() {
+        kind = Kind::None;
+    }
+
+    bool isOpen() const {
+        return kind != Kind::None;
+    }
+
+    Kind getKind() const {
+        return kind;
+    }
+
+    const string& getInput() const {
+        return input;
+    }
+
+    Result handleEvent(const sf::Event& event) {
+        if (kind == Kind::None)
+            return Result::Ignored;
+        if (event.type == sf::Event::KeyPressed) {
+            skipText = false;
+            switch (event.key.code) {
+            case sf::Keyboard::Escape:
+                close();
+                return Result::Closed;
+            case sf::Keyboard::Enter:
+                if (kind == Kind::Help) {
+                    close();
+                    return Result::Closed;
+                }
+                close();
+                return Result::Submitted;
+            case sf::Keyboard::F1:
+                if (kind == Kind::Help) {
+                    close();
+                    return Result::Closed;
+                }
+                return Result::Handled;
+            case sf::Keyboard::Backspace:
+                if (kind == Kind::Prompt && !input.empty()) {
+                    input.pop_back();
+                    inputText.setString(input);
+                }
+                return Result::Handled;
+            default:
+                return Result::Handled;
+            }
+        }
+        if (event.type == sf::Event::TextEntered) {
+            if (skipText) {
+                skipText = false;
+                return Result::Handled;
+            }
+            // Enter and Backspace come as key presses.
+            if (kind == Kind::Prompt && event.text.unicode >= 32 && event.text.unicode < 127) {
+                input += static_cast<char>(event.text.unicode);
+                inputText.setString(input);
+            }
+            return Result::Handled;
+        }
+        if (event.type == sf::Event::KeyReleased || event.type == sf::Event::MouseButtonPressed ||
+            event.type == sf::Event::MouseButtonReleased)
+            return Result::Handled;
+        return Result::Ignored;
+    }
+
+    // Centered in the window, whatever view the scene is drawn with.
+    void draw(sf::RenderWindow& window) {
+        if (kind == Kind::None)
+            return;
+        sf::View sceneView = window.getView();
+        sf::Vector2u windowSize = window.getSize();
+        window.setView(sf::View(sf::FloatRect(0.f, 0.f, static_cast<float>(windowSize.x), static_cast<float>(windowSize.y))));
+
+        sf::FloatRect text = title.getLocalBounds();
+        sf::Vector2f size(text.left + text.width + 2 * margin, text.top + text.height + 2 * margin);
+        if (kind == Kind::Prompt) {
+            size.x = max(size.x, promptWidth);
+            size.y += 30.f + margin;
+        }
+        sf::Vector2f corner((windowSize.x - size.x) / 2.f, (windowSize.y - size.y) / 2.f);
+        corner.x = max(corner.x, 0.f);
+        corner.y = max(corner.y, 0.f);
+        panel.setSize(size);
+        panel.setPosition(corner);
+        window.draw(panel);
+        title.setPosition(corner.x + margin, corner.y + margin);
+        window.draw(title);
+        if (kind == Kind::Prompt) {
+            inputBox.setSize(sf::Vector2f(size.x - 2 * margin, 30.f));
+            inputBox.setPosition(corner.x + margin, corner.y + size.y - margin - 30.f);
+            window.draw(inputBox);
+            inputText.setPosition(inputBox.getPosition().x + 5.f, inputBox.getPosition().y + 5.f);
+            window.draw(inputText);
+        }
+        window.setView(sceneView);
+    }
+};
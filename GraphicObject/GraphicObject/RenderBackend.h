@@ -0,0 +1,24 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include "ShapeStore.h"
+
+using namespace std;
+
+// Target of GraphicObject::draw. Shapes hand over their store entry and the
+// backend decides how to turn position, size and color into pixels.
+class RenderBackend {
+public:
+    virtual ~RenderBackend() {}
+
+    virtual void clear(sf::Color color) = 0;
+    virtual void drawShape(const ShapeStore& store, unsigned index) = 0;
+    virtual void display() = 0;
+
+    // Draws shapes back to front in the given order.
+    virtual void drawShapes(const ShapeStore& store, const vector<ShapeHandle>& handles) {
+        for (auto handle : handles)
+            drawShape(store, store.indexOf(handle));
+    }
+};
@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include <type_traits>
+#include <vector>
+#include "GraphicObject.h"
+#include "SceneArena.h"
+#include "ShapeStore.h"
+
+using namespace std;
+
+// A stretch of consecutive leaves, in draw order, with the same color and
+// visibility; see Scene::captureColors.
+struct ColorRun {
+    sf::Uint32 color;
+    unsigned char visible;
+    unsigned count;
+};
+
+// Everything that makes up one scene: the shape columns, the arena the
+// objects live in and the top-level objects, which the scene owns.
+// Objects refer to the store by reference, so a Scene is not movable;
+// keep it behind a pointer to replace it.
+class Scene {
+public:
+    SceneArena arena;
+    ShapeStore store;
+    vector<GraphicObject*> objects;
+
+private:
+    vector<ShapeHandle> handles;
+
+public:
+    Scene() {}
+
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        if constexpr (is_same<T, Aggregate>::value)
+            return arena.create<Aggregate>(store, arena);
+        else
+            return arena.create<T>(store, forward<Args>(args)...);
+    }
+
+    // A default object of a binary scene node type.
+    GraphicObject* createNode(BinaryNodeType node) {
+        GraphicObject* object = nullptr;
+        if (!LeafShapes::visitNode(node, [&](auto shape) { object = create<typename decltype(shape)::type>(); }))
+            object = create<Aggregate>();
+        return object;
+    }
+
+    // The colors and visibility of an object's leaves, run-length encoded:
+    // a few runs even for an Aggregate of a million shapes.
+    void captureColors(GraphicObject* object, vector<ColorRun>& runs) {
+        handles.clear();
+        object->collectHandles(handles);
+        runs.clear();
+        for (auto handle : handles) {
+            unsigned i = store.indexOf(handle);
+            sf::Uint32 color = store.color[i];
+            unsigned char visible = store.visible[i];
+            if (!runs.empty() && runs.back().color == color && runs.back().visible == visible)
+                runs.back().count++;
+            else
+                runs.push_back({ color, visible, 1 });
+        }
+        runs.shrink_to_fit();
+    }
+
+    void restoreColors(GraphicObject* object, const vector<ColorRun>& runs) {
+        handles.clear();
+        object->collectHandles(handles);
+        size_t next = 0;
+        for (auto& run : runs) {
+            for (unsigned k = 0; k < run.count && next < handles.size(); k++, next++) {
+                unsigned i = store.indexOf(handles[next]);
+                store.changeColorRange(i, i + 1, sf::Color(run.color));
+                store.setVisibleRange(i, i + 1, run.visible != 0);
+            }
+        }
+    }
+
+    // Removes a single object (and its subtree) from the scene.
+    void destroy(GraphicObject* object) {
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (objects[i] == object) {
+                objects.erase(objects.begin() + i);
+                break;
+            }
+        }
+        arena.destroy(object);
+    }
+
+    // Drops the whole scene without visiting the objects.
+    void clear() {
+        objects.clear();
+        store.clear();
+        arena.release();
+    }
+};
@@ -0,0 +1,44 @@
+﻿#pragma once
+
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+using namespace std;
+
+// Memory for all objects of one scene. Objects are carved out of large blocks
+// and the whole arena is released at once when the scene is replaced, so
+// loading millions of shapes is a handful of allocations and a reset does not
+// visit the objects at all.
+class SceneArena {
+private:
+    pmr::monotonic_buffer_resource resource;
+
+public:
+    SceneArena() : resource(64 * 1024) {}
+
+    SceneArena(const SceneArena&) = delete;
+    SceneArena& operator=(const SceneArena&) = delete;
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        void* memory = resource.allocate(sizeof(T), alignof(T));
+        return new (memory) T(forward<Args>(args)...);
+    }
+
+    // Runs the destructor; the memory is reclaimed when the arena is released.
+    template <typename T>
+    void destroy(T* object) {
+        if (object)
+            object->~T();
+    }
+
+    // Drops every block without running destructors.
+    void release() {
+        resource.release();
+    }
+
+    pmr::memory_resource* getResource() {
+        return &resource;
+    }
+};
@@ -0,0 +1,225 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "BinaryScene.h"
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "SceneJournal.h"
+#include "UndoHistory.h"
+
+using namespace std;
+
+// One scene edit sent from outside the window: a simulation thread, a script
+// or a connection. Producers name top-level objects with ids of their own
+// choosing, given at creation; the queue maps them to scene objects.
+struct SceneCommand {
+    enum Kind : uint32_t {
+        Create,         // node: the object type
+        Move,           // x, y: offset
+        Recolor,        // color
+        Resize,         // x: the size, as with changeSize
+        SetVisible      // visible
+    };
+
+    Kind kind;
+    uint32_t object;
+    BinaryNodeType node;
+    float x;
+    float y;
+    uint32_t color;
+    bool visible;
+
+    static SceneCommand create(uint32_t object, BinaryNodeType node) {
+        return { Create, object, node, 0.f, 0.f, 0, true };
+    }
+
+    static SceneCommand move(uint32_t object, float dx, float dy) {
+        return { Move, object, BinaryAggregate, dx, dy, 0, true };
+    }
+
+    static SceneCommand recolor(uint32_t object, sf::Color color) {
+        return { Recolor, object, BinaryAggregate, 0.f, 0.f, color.toInteger(), true };
+    }
+
+    static SceneCommand resize(uint32_t object, float size) {
+        return { Resize, object, BinaryAggregate, size, 0.f, 0, true };
+    }
+
+    static SceneCommand setVisible(uint32_t object, bool visible) {
+        return { SetVisible, object, BinaryAggregate, 0.f, 0.f, 0, visible };
+    }
+};
+
+// Bounded queue of scene commands from any number of producer threads to the
+// window thread, which applies them in batches between frames.
+//
+// The ring is the bounded MPMC queue of D. Vyukov: every cell carries a
+// sequence number telling whose turn it is, producers claim a position with
+// one compare-and-swap and publish the command with a release store. No side
+// ever takes a lock or waits for the other; a producer finding the ring full
+// gets false back and decides itself whether to retry or drop.
+// The consumer side is single-threaded (it is the window thread).
+//
+// Latency is bounded from both ends: a frame applies at most its budget of
+// commands, and the ring holds at most capacity of them, so a command is
+// applied within capacity / budget frames of being pushed.
+class SceneCommandQueue {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        SceneCommand command;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePosition;
+    alignas(64) size_t dequeuePosition;
+
+    // Window thread only.
+    unordered_map<uint32_t, uint32_t> objects;
+    vector<SceneCommand> batch;
+    size_t dropped;
+
+    bool pop(SceneCommand& command) {
+        Cell& cell = cells[dequeuePosition & mask];
+        if (cell.sequence.load(memory_order_acquire) != dequeuePosition + 1)
+            return false;
+        command = cell.command;
+        cell.sequence.store(dequeuePosition + mask + 1, memory_order_release);
+        dequeuePosition++;
+        return true;
+    }
+
+    GraphicObject* find(Scene& scene, uint32_t id, size_t& index) {
+        auto found = objects.find(id);
+        if (found == objects.end() || found->second >= scene.objects.size()) {
+            dropped++;
+            return nullptr;
+        }
+        index = found->second;
+        return scene.objects[index];
+    }
+
+public:
+    // capacity is rounded up to a power of two.
+    SceneCommandQueue(size_t capacity = 1 << 16) : enqueuePosition(0), dequeuePosition(0), dropped(0) {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++)
+            cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    SceneCommandQueue(const SceneCommandQueue&) = delete;
+    SceneCommandQueue& operator=(const SceneCommandQueue&) = delete;
+
+    // Any thread. False when the queue is full.
+    bool push(const SceneCommand& command) {
+        size_t position = enqueuePosition.load(memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = enqueuePosition.load(memory_order_relaxed);
+            }
+        }
+        Cell& cell = cells[position & mask];
+        cell.command = command;
+        cell.sequence.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    // The rest is for the window thread.
+
+    // Applies up to budget queued commands to the scene; returns how many.
+    // Consecutive moves of one object are applied as one. Every change goes
+    // to the autosave journal of the history. Objects created here are not
+    // undoable, and since the history names objects by position, creating
+    // one also clears the history. The batch's journal records are written
+    // with a single flush at the end.
+    size_t drain(Scene& scene, UndoHistory& history, size_t budget = 1 << 16) {
+        batch.clear();
+        SceneCommand command;
+        while (batch.size() < budget && pop(command))
+            batch.push_back(command);
+        SceneJournal* journal = history.getJournal();
+        for (size_t k = 0; k < batch.size(); k++) {
+            const SceneCommand& next = batch[k];
+            size_t index = 0;
+            if (next.kind == SceneCommand::Create) {
+                if (next.node > BinaryAggregate || objects.count(next.object)) {
+                    dropped++;
+                    continue;
+                }
+                objects[next.object] = static_cast<uint32_t>(scene.objects.size());
+                scene.objects.push_back(scene.createNode(next.node));
+                history.clear();
+                if (journal)
+                    journal->created(next.node);
+                continue;
+            }
+            GraphicObject* object = find(scene, next.object, index);
+            if (!object)
+                continue;
+            switch (next.kind) {
+            case SceneCommand::Move: {
+                float dx = next.x, dy = next.y;
+                while (k + 1 < batch.size() && batch[k + 1].kind == SceneCommand::Move && batch[k + 1].object == next.object) {
+                    k++;
+                    dx += batch[k].x;
+                    dy += batch[k].y;
+                }
+                object->move(dx, dy);
+                if (journal)
+                    journal->placed(index, object->getPlacement());
+                break;
+            }
+            case SceneCommand::Recolor:
+                object->changeColor(sf::Color(next.color));
+                if (journal)
+                    journal->recolored(index, sf::Color(next.color));
+                break;
+            case SceneCommand::Resize:
+                object->changeSize(next.x);
+                if (journal)
+                    journal->placed(index, object->getPlacement());
+                break;
+            case SceneCommand::SetVisible:
+                object->setVisible(next.visible);
+                if (journal)
+                    journal->visibilityChanged(index, next.visible);
+                break;
+            default:
+                break;
+            }
+        }
+        if (journal)
+            journal->flush();
+        return batch.size();
+    }
+
+    // Call when the scene is replaced: the ids named its objects.
+    void forgetObjects() {
+        objects.clear();
+    }
+
+    // Commands naming unknown objects or ids already in use, so far.
+    size_t getDropped() const {
+        return dropped;
+    }
+};
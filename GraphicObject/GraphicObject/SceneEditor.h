@@ -0,0 +1,148 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <memory>
+#include <vector>
+#include "DrawOrder.h"
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "SpatialGrid.h"
+#include "UndoHistory.h"
+
+using namespace std;
+
+// The editing keys of the main window and the selection they act on. The
+// window and the replay driver both go through here, so a replayed session
+// runs exactly the code a live one does.
+class SceneEditor {
+public:
+    // What a key or click did, so the caller knows what to update.
+    enum class Result {
+        Ignored,        // not an editing key
+        Selected,       // only the selection changed
+        Changed,
+        SceneReplaced   // caches of the old scene must be dropped
+    };
+
+private:
+    unique_ptr<Scene>& scene;
+    UndoHistory& history;
+    int currentObject;
+    float currentScale;
+    const float scaleIncrement = 0.1f;
+    vector<ShapeHandle> picked;
+
+    bool hasSelection() const {
+        return !scene->objects.empty();
+    }
+
+    Result afterHistory(UndoHistory::Effect effect) {
+        if (effect == UndoHistory::Effect::SceneReplaced)
+            currentObject = 0;
+        if (currentObject >= static_cast<int>(scene->objects.size()))
+            currentObject = scene->objects.empty() ? 0 : static_cast<int>(scene->objects.size()) - 1;
+        return effect == UndoHistory::Effect::SceneReplaced ? Result::SceneReplaced : Result::Changed;
+    }
+
+public:
+    SceneEditor(unique_ptr<Scene>& scene, UndoHistory& history)
+        : scene(scene), history(history), currentObject(0), currentScale(1.f) {}
+
+    int getCurrentObject() const {
+        return currentObject;
+    }
+
+    Result handleKey(sf::Keyboard::Key key, bool control, bool shift) {
+        if (control && (key == sf::Keyboard::Z || key == sf::Keyboard::Y)) {
+            bool redo = key == sf::Keyboard::Y || shift;
+            return afterHistory(redo ? history.redo(scene) : history.undo(scene));
+        }
+        switch (key) {
+        case sf::Keyboard::C:
+            currentObject = static_cast<int>(history.create<Circle>(*scene));
+            return Result::Changed;
+        case sf::Keyboard::R:
+            currentObject = static_cast<int>(history.create<Rectangle>(*scene));
+            return Result::Changed;
+        case sf::Keyboard::T:
+            currentObject = static_cast<int>(history.create<Triangle>(*scene));
+            return Result::Changed;
+        case sf::Keyboard::A:
+            currentObject = static_cast<int>(history.create<Aggregate>(*scene));
+            return Result::Changed;
+        case sf::Keyboard::Tab:
+            currentObject++;
+            if (currentObject >= static_cast<int>(scene->objects.size()))
+                currentObject = 0;
+            return Result::Selected;
+        default:
+            break;
+        }
+        if (!hasSelection())
+            return Result::Ignored;
+        switch (key) {
+        case sf::Keyboard::Up:
+            history.move(*scene, currentObject, 0, -10);
+            return Result::Changed;
+        case sf::Keyboard::Down:
+            history.move(*scene, currentObject, 0, 10);
+            return Result::Changed;
+        case sf::Keyboard::Left:
+            history.move(*scene, currentObject, -10, 0);
+            return Result::Changed;
+        case sf::Keyboard::Right:
+            history.move(*scene, currentObject, 10, 0);
+            return Result::Changed;
+        case sf::Keyboard::Num1:
+            history.recolor(*scene, currentObject, sf::Color::Red);
+            return Result::Changed;
+        case sf::Keyboard::Num2:
+            history.recolor(*scene, currentObject, sf::Color::Green);
+            return Result::Changed;
+        case sf::Keyboard::Num3:
+            history.recolor(*scene, currentObject, sf::Color::Blue);
+            return Result::Changed;
+        case sf::Keyboard::Add:
+            currentScale += scaleIncrement;
+            history.resize(*scene, currentObject, currentScale);
+            return Result::Changed;
+        case sf::Keyboard::Subtract:
+            currentScale -= scaleIncrement;
+            if (currentScale < 0.1f)
+                currentScale = 0.1f;
+            history.resize(*scene, currentObject, currentScale);
+            return Result::Changed;
+        case sf::Keyboard::V:
+            history.setVisible(*scene, currentObject, !scene->objects[currentObject]->isVisible());
+            return Result::Changed;
+        default:
+            return Result::Ignored;
+        }
+    }
+
+    // Selects the top-level object owning the topmost shape at a point in
+    // scene coordinates; keeps the selection when there is none.
+    Result click(DrawOrder& order, SpatialGrid& grid, float x, float y) {
+        order.update(scene->store, scene->objects);
+        grid.update(scene->store);
+        picked.clear();
+        grid.queryPoint(scene->store, x, y, picked);
+        int topmost = -1;
+        for (size_t i = 0; i < picked.size(); i++) {
+            if (order.rootOf(picked[i]) < 0)
+                continue;
+            if (topmost < 0 || order.orderOf(picked[i]) > order.orderOf(picked[topmost]))
+                topmost = static_cast<int>(i);
+        }
+        if (topmost >= 0)
+            currentObject = order.rootOf(picked[topmost]);
+        return Result::Selected;
+    }
+
+    // Puts a loaded scene in place of the current one, undoably.
+    Result replaceScene(unique_ptr<Scene> loaded) {
+        history.replaceScene(scene, move(loaded));
+        currentObject = 0;
+        return Result::SceneReplaced;
+    }
+};
@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BinaryScene.h"
+#include "FileProgress.h"
+#include "Scene.h"
+#include "SceneFiles.h"
+
+using namespace std;
+
+// A scene save or load running on its own thread while the window keeps going.
+//
+// A save copies the scene into binary records on the calling thread first (a
+// single walk, much faster than formatting the file), so the scene may be
+// edited or replaced as soon as save() returns. The file is written next to
+// the target and renamed over it at the end, so a cancelled or failed save
+// leaves any existing file untouched.
+// A load builds a new Scene that the caller takes over once isFinished()
+// reports true; the current scene is not touched until then.
+// Destroying a task cancels it and waits for the thread.
+class SceneFileTask {
+private:
+    string filename;
+    bool loading;
+    FileProgress progress;
+    atomic<bool> finished;
+    bool succeeded;
+    string error;
+
+    BinarySceneWriter snapshot;
+    vector<uint32_t> roots;
+    unique_ptr<Scene> scene;
+
+    thread worker;
+
+    SceneFileTask(const string& filename, bool loading)
+        : filename(filename), loading(loading), finished(false), succeeded(false) {}
+
+    void runSave() {
+        string partial = filename + ".part";
+        bool written = isCompressedSceneFile(filename) ? saveCompressedScene(partial, snapshot, roots, &progress) :
+            isBinarySceneFile(filename) ? snapshot.write(partial, roots, &progress) : saveTextScene(partial, snapshot, roots, &progress);
+        if (written && !progress.cancelled) {
+            // Replaces the old file in one step where the file system allows it.
+            error_code renameError;
+            filesystem::rename(partial, filename, renameError);
+            written = !renameError;
+        }
+        if (!written || progress.cancelled)
+            remove(partial.c_str());
+        succeeded = written && !progress.cancelled;
+        if (!succeeded)
+            error = progress.cancelled ? filename + ": cancelled" : "Cannot write " + filename;
+        progress.done = progress.total.load();
+    }
+
+    void runLoad() {
+        scene.reset(new Scene());
+        succeeded = loadScene(filename, *scene, &error, &progress);
+        if (!succeeded)
+            scene.reset();
+    }
+
+public:
+    ~SceneFileTask() {
+        cancel();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    SceneFileTask(const SceneFileTask&) = delete;
+    SceneFileTask& operator=(const SceneFileTask&) = delete;
+
+    static unique_ptr<SceneFileTask> save(const string& filename, Scene& scene) {
+        unique_ptr<SceneFileTask> task(new SceneFileTask(filename, false));
+        for (auto object : scene.objects)
+            task->roots.push_back(object->saveBinary(task->snapshot));
+        SceneFileTask* self = task.get();
+        task->worker = thread([self] {
+            self->runSave();
+            self->finished = true;
+        });
+        return task;
+    }
+
+    static unique_ptr<SceneFileTask> load(const string& filename) {
+        unique_ptr<SceneFileTask> task(new SceneFileTask(filename, true));
+        SceneFileTask* self = task.get();
+        task->worker = thread([self] {
+            self->runLoad();
+            self->finished = true;
+        });
+        return task;
+    }
+
+    bool isLoading() const {
+        return loading;
+    }
+
+    const string& getFilename() const {
+        return filename;
+    }
+
+    double getProgress() const {
+        return progress.fraction();
+    }
+
+    void cancel() {
+        progress.cancelled = true;
+    }
+
+    bool isFinished() const {
+        return finished;
+    }
+
+    // The results below may only be read once isFinished() is true.
+
+    bool hasSucceeded() const {
+        return succeeded;
+    }
+
+    const string& getError() const {
+        return error;
+    }
+
+    // The loaded scene; null after a failed load or a save.
+    unique_ptr<Scene> takeScene() {
+        return move(scene);
+    }
+};
@@ -0,0 +1,346 @@
+﻿#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "BinaryScene.h"
+#include "CompressedScene.h"
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "SceneParser.h"
+#include "ShapeFormat.h"
+
+using namespace std;
+
+// Scenes whose file name ends with this extension use the binary format.
+const string binarySceneExtension = ".gob";
+// And these the compressed format.
+const string compressedSceneExtension = ".gobz";
+
+inline bool isBinarySceneFile(const string& filename) {
+    return filename.size() >= binarySceneExtension.size() &&
+        filename.compare(filename.size() - binarySceneExtension.size(), binarySceneExtension.size(), binarySceneExtension) == 0;
+}
+
+inline bool isCompressedSceneFile(const string& filename) {
+    return filename.size() >= compressedSceneExtension.size() &&
+        filename.compare(filename.size() - compressedSceneExtension.size(), compressedSceneExtension.size(), compressedSceneExtension) == 0;
+}
+
+inline bool saveTextScene(const string& filename, Scene& scene) {
+    ofstream file(filename);
+    if (!file.is_open())
+        return false;
+    file << scene.objects.size() << "\n";
+    saveObjects(file, scene.objects, scene.store);
+    file.flush();
+    return file.good();
+}
+
+// On failure *error (if given) receives "file:line: message".
+inline bool loadTextScene(const string& filename, Scene& scene, string* error = nullptr, FileProgress* progress = nullptr) {
+    TextSceneParser parser;
+    if (parser.open(filename) && parser.parse(scene, progress))
+        return true;
+    if (error)
+        *error = filename + ":" + to_string(parser.getErrorLine()) + ": " + parser.getError();
+    return false;
+}
+
+inline bool saveBinaryScene(const string& filename, Scene& scene) {
+    BinarySceneWriter writer;
+    vector<uint32_t> roots;
+    for (auto object : scene.objects)
+        roots.push_back(object->saveBinary(writer));
+    return writer.write(filename, roots);
+}
+
+// Builds shapes from a mapped binary scene. Aggregates are built in record
+// order; since children are written before their parents, every child
+// Aggregate already exists when its parent is built.
+// Progress is counted in nodes; cancelling it fails the load.
+inline bool loadBinaryScene(const BinarySceneView& view, Scene& scene, FileProgress* progress = nullptr) {
+    const BinarySceneHeader& header = view.getHeader();
+    if (progress)
+        progress->total = header.childCount;
+    vector<Aggregate*> aggregates(header.aggregateCount, nullptr);
+    vector<bool> used(header.aggregateCount, false);
+    vector<GraphicObject*> roots;
+
+    // Unadopted aggregates and the roots own everything created so far.
+    auto discard = [&]() {
+        for (uint32_t a = 0; a < header.aggregateCount; a++) {
+            if (aggregates[a] && !used[a])
+                scene.arena.destroy(aggregates[a]);
+        }
+        for (auto object : roots)
+            scene.arena.destroy(object);
+        return false;
+    };
+
+    auto createNode = [&](uint32_t ref, uint32_t limit) -> GraphicObject* {
+        if (!view.isValidRef(ref))
+            return nullptr;
+        if (progress && ++progress->done % FileProgress::step == 0 && progress->cancelled)
+            return nullptr;
+        uint32_t recordIndex = nodeRefIndex(ref);
+        GraphicObject* object = nullptr;
+        if (LeafShapes::visitNode(nodeRefType(ref), [&](auto shape) {
+            using Shape = typename decltype(shape)::type;
+            float values[ShapeFormat<Shape>::valueCount];
+            const auto& record = view.records<typename ShapeFormat<Shape>::Record>()[recordIndex];
+            readShapeRecord<Shape>(record, values);
+            Shape* created = scene.create<Shape>();
+            created->setValues(values, record.color);
+            object = created;
+        }))
+            return object;
+        // A child Aggregate must be an earlier, not yet adopted one: this rules out cycles and sharing.
+        if (recordIndex >= limit || used[recordIndex])
+            return nullptr;
+        used[recordIndex] = true;
+        return aggregates[recordIndex];
+    };
+
+    const uint32_t* children = view.children();
+    for (uint32_t a = 0; a < header.aggregateCount; a++) {
+        const AggregateRecord& record = view.aggregates()[a];
+        Aggregate* aggregate = scene.create<Aggregate>();
+        aggregates[a] = aggregate;
+        for (uint32_t c = 0; c < record.childCount; c++) {
+            GraphicObject* child = createNode(children[record.firstChild + c], a);
+            if (!child)
+                return discard();
+            aggregate->addObject(child);
+        }
+    }
+    for (uint32_t r = 0; r < header.rootCount; r++) {
+        GraphicObject* object = createNode(children[header.rootFirst + r], header.aggregateCount);
+        if (!object)
+            return discard();
+        roots.push_back(object);
+    }
+    scene.objects.insert(scene.objects.end(), roots.begin(), roots.end());
+    return true;
+}
+
+inline bool loadBinaryScene(const string& filename, Scene& scene, FileProgress* progress = nullptr) {
+    MappedFile file;
+    BinarySceneView view;
+    if (!file.open(filename) || !view.open(file))
+        return false;
+    return loadBinaryScene(view, scene, progress);
+}
+
+// Writes the subtree of one snapshot node in the text format.
+inline bool writeTextNode(ostream& file, const BinarySceneWriter& snapshot, uint32_t ref, FileProgress* progress) {
+    if (progress && ++progress->done % FileProgress::step == 0 && progress->cancelled)
+        return false;
+    uint32_t index = nodeRefIndex(ref);
+    if (LeafShapes::visitNode(nodeRefType(ref), [&](auto shape) {
+        using Shape = typename decltype(shape)::type;
+        float values[ShapeFormat<Shape>::valueCount];
+        const auto& record = snapshot.getRecords<typename ShapeFormat<Shape>::Record>()[index];
+        readShapeRecord<Shape>(record, values);
+        writeShapeText<Shape>(file, values, record.color);
+    }))
+        return true;
+    const AggregateRecord& record = snapshot.getAggregates()[index];
+    file << "Aggregate\n" << record.childCount << "\n";
+    for (uint32_t c = 0; c < record.childCount; c++)
+        if (!writeTextNode(file, snapshot, snapshot.getChildren()[record.firstChild + c], progress))
+            return false;
+    return true;
+}
+
+// Writes a scene collected by BinarySceneWriter in the text format; the same
+// text as saveTextScene gives for the scene itself. Stops early, returning
+// false, when progress is cancelled.
+inline bool saveTextScene(const string& filename, const BinarySceneWriter& snapshot, const vector<uint32_t>& roots,
+                          FileProgress* progress = nullptr) {
+    ofstream file(filename);
+    if (!file.is_open())
+        return false;
+    if (progress)
+        progress->total = snapshot.getRecords<CircleRecord>().size() + snapshot.getRecords<RectangleRecord>().size() +
+            snapshot.getRecords<TriangleRecord>().size() + snapshot.getAggregates().size();
+    file << roots.size() << "\n";
+    for (auto root : roots)
+        if (!writeTextNode(file, snapshot, root, progress))
+            return false;
+    file.flush();
+    return file.good();
+}
+
+// Writes the subtree of one snapshot node in the compressed format.
+inline bool writeCompressedNode(CompressedSceneWriter& writer, const BinarySceneWriter& snapshot, uint32_t ref,
+                                FileProgress* progress) {
+    if (progress && ++progress->done % FileProgress::step == 0 && progress->cancelled)
+        return false;
+    uint32_t index = nodeRefIndex(ref);
+    if (LeafShapes::visitNode(nodeRefType(ref), [&](auto shape) {
+        using Shape = typename decltype(shape)::type;
+        float values[ShapeFormat<Shape>::valueCount];
+        const auto& record = snapshot.getRecords<typename ShapeFormat<Shape>::Record>()[index];
+        readShapeRecord<Shape>(record, values);
+        writer.shape<Shape>(values, record.color);
+    }))
+        return true;
+    const AggregateRecord& record = snapshot.getAggregates()[index];
+    writer.aggregate(record.childCount);
+    for (uint32_t c = 0; c < record.childCount; c++)
+        if (!writeCompressedNode(writer, snapshot, snapshot.getChildren()[record.firstChild + c], progress))
+            return false;
+    return true;
+}
+
+// Writes a snapshot in the compressed format; see CompressedSceneWriter::open
+// for quantum and rounding.
+inline bool saveCompressedScene(const string& filename, const BinarySceneWriter& snapshot, const vector<uint32_t>& roots,
+                                FileProgress* progress = nullptr, float quantum = compressedSceneQuantum, bool rounding = false) {
+    CompressedSceneWriter writer;
+    if (!writer.open(filename, quantum, rounding))
+        return false;
+    if (progress)
+        progress->total = snapshot.getRecords<CircleRecord>().size() + snapshot.getRecords<RectangleRecord>().size() +
+            snapshot.getRecords<TriangleRecord>().size() + snapshot.getAggregates().size();
+    writer.roots(static_cast<uint32_t>(roots.size()));
+    for (auto root : roots)
+        if (!writeCompressedNode(writer, snapshot, root, progress))
+            return false;
+    return writer.finish();
+}
+
+inline bool saveCompressedScene(const string& filename, Scene& scene, float quantum = compressedSceneQuantum, bool rounding = false) {
+    BinarySceneWriter snapshot;
+    vector<uint32_t> roots;
+    for (auto object : scene.objects)
+        roots.push_back(object->saveBinary(snapshot));
+    return saveCompressedScene(filename, snapshot, roots, nullptr, quantum, rounding);
+}
+
+// Builds nested Aggregates with an explicit stack, like TextSceneParser.
+// Progress is counted in file bytes; cancelling it fails the load.
+inline bool loadCompressedScene(const string& filename, Scene& scene, FileProgress* progress = nullptr) {
+    struct Frame {
+        Aggregate* aggregate;
+        uint32_t remaining;
+    };
+    vector<Frame> stack;
+    vector<GraphicObject*> loaded;
+
+    auto discard = [&]() {
+        for (auto object : loaded)
+            scene.arena.destroy(object);
+        return false;
+    };
+
+    CompressedSceneReader reader;
+    uint32_t topRemaining;
+    if (!reader.open(filename) || !reader.readRoots(topRemaining))
+        return false;
+    if (progress)
+        progress->total = reader.getFileSize();
+    size_t count = 0;
+    for (;;) {
+        if (progress && ++count % FileProgress::step == 0) {
+            progress->done = reader.getBytesRead();
+            if (progress->cancelled)
+                return discard();
+        }
+        Aggregate* parent = nullptr;
+        if (stack.empty()) {
+            if (topRemaining == 0)
+                break;
+            topRemaining--;
+        }
+        else if (stack.back().remaining == 0) {
+            stack.pop_back();
+            continue;
+        }
+        else {
+            stack.back().remaining--;
+            parent = stack.back().aggregate;
+        }
+
+        BinaryNodeType node;
+        if (!reader.readNode(node))
+            return discard();
+        GraphicObject* object = nullptr;
+        uint32_t childCount = 0;
+        bool valid = true;
+        if (!LeafShapes::visitNode(node, [&](auto shape) {
+            using Shape = typename decltype(shape)::type;
+            float values[ShapeFormat<Shape>::valueCount];
+            uint32_t color;
+            if (!reader.readShape<Shape>(values, color)) {
+                valid = false;
+                return;
+            }
+            Shape* created = scene.create<Shape>();
+            created->setValues(values, color);
+            object = created;
+        })) {
+            valid = reader.readChildCount(childCount);
+            if (valid)
+                object = scene.create<Aggregate>();
+        }
+        if (!valid)
+            return discard();
+        if (parent)
+            parent->addObject(object);
+        else
+            loaded.push_back(object);
+        if (childCount > 0) {
+            Frame frame = { static_cast<Aggregate*>(object), childCount };
+            stack.push_back(frame);
+        }
+    }
+    if (!reader.finish())
+        return discard();
+    scene.objects.insert(scene.objects.end(), loaded.begin(), loaded.end());
+    if (progress)
+        progress->done = reader.getFileSize();
+    return true;
+}
+
+inline bool saveScene(const string& filename, Scene& scene) {
+    if (isCompressedSceneFile(filename))
+        return saveCompressedScene(filename, scene);
+    if (isBinarySceneFile(filename))
+        return saveBinaryScene(filename, scene);
+    return saveTextScene(filename, scene);
+}
+
+inline bool loadScene(const string& filename, Scene& scene, string* error = nullptr, FileProgress* progress = nullptr) {
+    if (isCompressedSceneFile(filename)) {
+        if (loadCompressedScene(filename, scene, progress))
+            return true;
+        if (error)
+            *error = filename + (progress && progress->cancelled ? ": cancelled" : ": not a valid compressed scene");
+        return false;
+    }
+    if (isBinarySceneFile(filename)) {
+        if (loadBinaryScene(filename, scene, progress))
+            return true;
+        if (error)
+            *error = filename + (progress && progress->cancelled ? ": cancelled" : ": not a valid binary scene");
+        return false;
+    }
+    return loadTextScene(filename, scene, error, progress);
+}
+
+// Converts between the text, binary and compressed formats, chosen by file
+// extension. A compressed destination is rounded to quantum when it is given.
+inline bool convertScene(const string& source, const string& destination, float quantum = 0.f) {
+    Scene scene;
+    string error;
+    if (!loadScene(source, scene, &error)) {
+        cerr << error << endl;
+        return false;
+    }
+    if (quantum > 0.f && isCompressedSceneFile(destination))
+        return saveCompressedScene(destination, scene, quantum, true);
+    return saveScene(destination, scene);
+}
@@ -0,0 +1,449 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "BinaryScene.h"
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "SceneFileTask.h"
+#include "SceneFiles.h"
+
+using namespace std;
+
+// Autosave as a journal of edits on top of a checkpoint.
+//
+// The saved state lives in generations. Generation g is the binary scene
+// base.g.gob (none for generation 0, which starts empty) plus the journal
+// base.g.journal, which appends one small record per edit, so saving costs
+// as much as the edit rather than the scene. Once a journal grows past a
+// quarter of its checkpoint the scene is compacted: a new generation starts
+// with an empty journal and its checkpoint is written on another thread.
+// Only when that checkpoint is complete are the older generations deleted.
+//
+// Recovery loads the newest checkpoint and replays the journals from its
+// generation on. A journal continues the previous one unless its generation
+// started from a replaced scene (a load), so while a checkpoint is still
+// missing its edits are recovered from the older generation's journals.
+// A record torn by a crash fails its checksum and ends the replay there.
+// Records are collected in memory and written with one flush per batch of
+// edits: the window calls flush() after each drain of the command queue and
+// update() once per frame, so a crash loses at most the edits of the frame
+// in progress. Surviving power loss as well would need an fsync per flush.
+//
+// Records name top-level objects by their position in Scene::objects and hold
+// absolute values (placements, colors), like the commands of UndoHistory,
+// which writes them.
+
+const char sceneJournalMagic[4] = { 'G', 'O', 'J', 'L' };
+const uint32_t sceneJournalVersion = 1;
+
+struct SceneJournalHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+    uint32_t continues;     // 0 when the generation starts from a replaced scene
+    uint32_t reserved;
+};
+
+enum SceneJournalKind : uint32_t {
+    JournalCreate = 1,      // payload: BinaryNodeType
+    JournalRemove = 2,      // the object, always the last one
+    JournalPlace = 3,       // payload: ObjectPlacement
+    JournalRecolor = 4,     // payload: color
+    JournalVisible = 5,     // payload: 0 or 1
+    JournalColors = 6       // payload: 0 or 1, then ColorRun[]
+};
+
+struct SceneJournalRecord {
+    uint32_t kind;
+    uint32_t object;
+    uint32_t size;          // of the payload that follows
+    uint32_t checksum;      // of the fields above and the payload
+};
+
+static_assert(sizeof(SceneJournalHeader) == 24, "SceneJournalHeader layout");
+static_assert(sizeof(SceneJournalRecord) == 16, "SceneJournalRecord layout");
+static_assert(is_trivially_copyable<ObjectPlacement>::value && is_trivially_copyable<ColorRun>::value,
+              "journal payloads are copied as bytes");
+
+class SceneJournal {
+private:
+    string base;
+    uint64_t generation;
+    uint64_t oldest;
+    ofstream journal;
+    uint64_t journalBytes;
+    uint64_t checkpointBytes;
+    bool failed;
+
+    unique_ptr<SceneFileTask> pending;
+    uint64_t pendingGeneration;
+    // Checkpoints replaced by a newer one before they were done. They are
+    // cancelled but not waited for; whatever they produce is ignored.
+    vector<unique_ptr<SceneFileTask>> superseded;
+
+    // Records not yet written to the journal file.
+    vector<char> unwritten;
+
+    // Compaction waits for at least this much journal.
+    static constexpr uint64_t minimumCompaction = 1 << 20;
+
+    string checkpointName(uint64_t g) const {
+        return base + "." + to_string(g) + binarySceneExtension;
+    }
+
+    string journalName(uint64_t g) const {
+        return base + "." + to_string(g) + ".journal";
+    }
+
+    static uint32_t checksum(const SceneJournalRecord& record, const char* payload) {
+        uint32_t hash = 2166136261u;
+        auto mix = [&](const char* bytes, size_t count) {
+            for (size_t k = 0; k < count; k++)
+                hash = (hash ^ static_cast<unsigned char>(bytes[k])) * 16777619u;
+        };
+        mix(reinterpret_cast<const char*>(&record), offsetof(SceneJournalRecord, checksum));
+        mix(payload, record.size);
+        return hash;
+    }
+
+    // Generations of base.g.gob and base.g.journal files next to base.
+    void listGenerations(vector<uint64_t>& checkpoints, vector<uint64_t>& journals) const {
+        filesystem::path path(base);
+        filesystem::path directory = path.parent_path().empty() ? filesystem::path(".") : path.parent_path();
+        string prefix = path.filename().string() + ".";
+        error_code error;
+        for (filesystem::directory_iterator entry(directory, error), end; !error && entry != end; entry.increment(error)) {
+            string name = entry->path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0)
+                continue;
+            size_t digits = prefix.size();
+            while (digits < name.size() && isdigit(static_cast<unsigned char>(name[digits])))
+                digits++;
+            if (digits == prefix.size() || digits - prefix.size() > 18)
+                continue;
+            uint64_t g = stoull(name.substr(prefix.size(), digits - prefix.size()));
+            string suffix = name.substr(digits);
+            if (suffix == binarySceneExtension)
+                checkpoints.push_back(g);
+            else if (suffix == ".journal")
+                journals.push_back(g);
+        }
+    }
+
+    void removeGenerations(uint64_t first, uint64_t last) {
+        error_code error;
+        for (uint64_t g = first; g < last; g++) {
+            filesystem::remove(checkpointName(g), error);
+            filesystem::remove(journalName(g), error);
+        }
+    }
+
+    bool openJournal(uint64_t g, bool continues) {
+        flush();
+        journal.close();
+        journal.clear();
+        journal.open(journalName(g), ios::binary | ios::trunc);
+        SceneJournalHeader header = {};
+        memcpy(header.magic, sceneJournalMagic, sizeof(header.magic));
+        header.version = sceneJournalVersion;
+        header.generation = g;
+        header.continues = continues ? 1 : 0;
+        journal.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        journal.flush();
+        generation = g;
+        journalBytes = sizeof(header);
+        return journal.good();
+    }
+
+    void append(SceneJournalKind kind, size_t object, const void* payload, size_t size) {
+        if (failed || !journal.is_open())
+            return;
+        SceneJournalRecord record = { kind, static_cast<uint32_t>(object), static_cast<uint32_t>(size), 0 };
+        size_t start = unwritten.size();
+        unwritten.resize(start + sizeof(record) + size);
+        char* bytes = unwritten.data() + start;
+        if (size)
+            memcpy(bytes + sizeof(record), payload, size);
+        record.checksum = checksum(record, bytes + sizeof(record));
+        memcpy(bytes, &record, sizeof(record));
+        journalBytes += sizeof(record) + size;
+    }
+
+    static bool apply(Scene& scene, const SceneJournalRecord& record, const char* payload) {
+        bool known = record.object < scene.objects.size();
+        GraphicObject* object = known ? scene.objects[record.object] : nullptr;
+        switch (record.kind) {
+        case JournalCreate: {
+            uint32_t node;
+            if (record.size != sizeof(node))
+                return false;
+            memcpy(&node, payload, sizeof(node));
+            if (node > BinaryAggregate)
+                return false;
+            scene.objects.push_back(scene.createNode(static_cast<BinaryNodeType>(node)));
+            return true;
+        }
+        case JournalRemove:
+            if (!known || record.object + 1 != scene.objects.size())
+                return false;
+            scene.destroy(object);
+            return true;
+        case JournalPlace: {
+            ObjectPlacement placement;
+            if (!known || record.size != sizeof(placement))
+                return false;
+            memcpy(&placement, payload, sizeof(placement));
+            object->setPlacement(placement);
+            return true;
+        }
+        case JournalRecolor: {
+            uint32_t color;
+            if (!known || record.size != sizeof(color))
+                return false;
+            memcpy(&color, payload, sizeof(color));
+            object->changeColor(sf::Color(color));
+            return true;
+        }
+        case JournalVisible:
+        case JournalColors: {
+            uint32_t visible;
+            if (!known || record.size < sizeof(visible) || (record.size - sizeof(visible)) % sizeof(ColorRun) != 0)
+                return false;
+            memcpy(&visible, payload, sizeof(visible));
+            object->setVisible(visible != 0);
+            if (record.kind == JournalColors) {
+                vector<ColorRun> runs((record.size - sizeof(visible)) / sizeof(ColorRun));
+                if (!runs.empty())
+                    memcpy(runs.data(), payload + sizeof(visible), runs.size() * sizeof(ColorRun));
+                scene.restoreColors(object, runs);
+            }
+            return true;
+        }
+        }
+        return false;
+    }
+
+    // Applies one journal; false when it is missing, belongs elsewhere or
+    // ends in a damaged record. *end receives the size of the good part.
+    bool replay(uint64_t g, bool first, Scene& scene, uint64_t* end) {
+        *end = 0;
+        MappedFile file;
+        if (!file.open(journalName(g)))
+            return false;
+        const char* data = file.getData();
+        size_t size = file.getSize();
+        SceneJournalHeader header;
+        if (size < sizeof(header))
+            return false;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, sceneJournalMagic, sizeof(header.magic)) != 0 || header.version != sceneJournalVersion ||
+            header.generation != g || (!first && !header.continues))
+            return false;
+        size_t offset = sizeof(header);
+        *end = offset;
+        while (size - offset >= sizeof(SceneJournalRecord)) {
+            SceneJournalRecord record;
+            memcpy(&record, data + offset, sizeof(record));
+            const char* payload = data + offset + sizeof(record);
+            if (record.size > size - offset - sizeof(record) || checksum(record, payload) != record.checksum)
+                return false;
+            if (!apply(scene, record, payload))
+                return false;
+            offset += sizeof(record) + record.size;
+            *end = offset;
+        }
+        return offset == size;
+    }
+
+public:
+    SceneJournal(const string& base = "autosave")
+        : base(base), generation(0), oldest(0), journalBytes(0), checkpointBytes(0), failed(false), pendingGeneration(0) {}
+
+    SceneJournal(const SceneJournal&) = delete;
+    SceneJournal& operator=(const SceneJournal&) = delete;
+
+    ~SceneJournal() {
+        flush();
+    }
+
+    const string& getBase() const {
+        return base;
+    }
+
+    // Rebuilds the autosaved state into an empty scene and opens the journal
+    // for the edits that follow. False (with *error) when the newest
+    // checkpoint cannot be read; the scene then stays empty, the old files
+    // are left alone and autosave starts over in a new generation.
+    bool recover(Scene& scene, string* error = nullptr) {
+        vector<uint64_t> checkpoints, journals;
+        listGenerations(checkpoints, journals);
+        uint64_t newest = 0;
+        for (auto g : checkpoints)
+            newest = max(newest, g + 1);
+        for (auto g : journals)
+            newest = max(newest, g + 1);
+        uint64_t start = 0;
+        for (auto g : checkpoints)
+            start = max(start, g);
+
+        if (start > 0) {
+            if (!loadBinaryScene(checkpointName(start), scene)) {
+                if (error)
+                    *error = checkpointName(start) + ": not a valid binary scene";
+                scene.clear();
+                generation = newest - 1;
+                oldest = newest;
+                checkpoint(scene, true);
+                return false;
+            }
+            error_code sizeError;
+            checkpointBytes = filesystem::file_size(checkpointName(start), sizeError);
+        }
+        uint64_t g = start;
+        uint64_t end = 0;
+        for (; g < newest; g++)
+            if (!replay(g, g == start, scene, &end))
+                break;
+        error_code fileError;
+        for (auto old : checkpoints)
+            if (old < start)
+                filesystem::remove(checkpointName(old), fileError);
+        for (auto old : journals)
+            if (old < start)
+                filesystem::remove(journalName(old), fileError);
+        oldest = start;
+
+        // Carry on in the last journal when everything replayed, dropping a
+        // record torn by a crash at its end. Otherwise what was recovered is
+        // no longer checkpoint plus journals, so it becomes a checkpoint.
+        bool whole = g == newest;
+        bool tornTail = g + 1 == newest && end > 0;
+        if (newest == 0) {
+            openJournal(0, true);
+            return true;
+        }
+        if (whole || tornTail) {
+            uint64_t last = newest - 1;
+            if (tornTail)
+                filesystem::resize_file(journalName(last), end, fileError);
+            else
+                end = filesystem::file_size(journalName(last), fileError);
+            journal.open(journalName(last), ios::binary | ios::app);
+            generation = last;
+            journalBytes = end;
+            return true;
+        }
+        generation = newest - 1;
+        checkpoint(scene, true);
+        return true;
+    }
+
+    // Edits, as made by UndoHistory.
+
+    void created(BinaryNodeType node) {
+        uint32_t value = node;
+        append(JournalCreate, 0, &value, sizeof(value));
+    }
+
+    void removed(size_t object) {
+        append(JournalRemove, object, nullptr, 0);
+    }
+
+    void placed(size_t object, const ObjectPlacement& placement) {
+        append(JournalPlace, object, &placement, sizeof(placement));
+    }
+
+    void recolored(size_t object, sf::Color color) {
+        uint32_t value = color.toInteger();
+        append(JournalRecolor, object, &value, sizeof(value));
+    }
+
+    void visibilityChanged(size_t object, bool visible) {
+        uint32_t value = visible ? 1 : 0;
+        append(JournalVisible, object, &value, sizeof(value));
+    }
+
+    void colorsRestored(size_t object, bool visible, const vector<ColorRun>& runs) {
+        vector<char> payload(sizeof(uint32_t) + runs.size() * sizeof(ColorRun));
+        uint32_t value = visible ? 1 : 0;
+        memcpy(payload.data(), &value, sizeof(value));
+        if (!runs.empty())
+            memcpy(payload.data() + sizeof(value), runs.data(), runs.size() * sizeof(ColorRun));
+        append(JournalColors, object, payload.data(), payload.size());
+    }
+
+    // Writes the records of the edits so far with one write and one flush.
+    void flush() {
+        if (unwritten.empty())
+            return;
+        if (!failed && journal.is_open()) {
+            journal.write(unwritten.data(), unwritten.size());
+            journal.flush();
+            if (!journal.good()) {
+                failed = true;
+                cerr << "Cannot write " << journalName(generation) << "; autosave is off" << endl;
+            }
+        }
+        unwritten.clear();
+    }
+
+    // Starts a new generation from the scene as it is. replaced says the
+    // scene is not the one the journal describes (it was loaded), so
+    // recovery must not carry older edits over into it. A checkpoint still
+    // being written is cancelled, without waiting for its thread to stop; the
+    // journals cover for it.
+    void checkpoint(Scene& scene, bool replaced) {
+        if (failed)
+            return;
+        if (pending) {
+            pending->cancel();
+            superseded.push_back(move(pending));
+        }
+        uint64_t next = generation + 1;
+        if (!openJournal(next, !replaced)) {
+            failed = true;
+            cerr << "Cannot write " << journalName(next) << "; autosave is off" << endl;
+            return;
+        }
+        pending = SceneFileTask::save(checkpointName(next), scene);
+        pendingGeneration = next;
+    }
+
+    // Once per frame: writes the frame's records, retires finished
+    // checkpoints, superseded ones included, and starts the next one when
+    // the journal has grown enough.
+    void update(Scene& scene) {
+        flush();
+        superseded.erase(remove_if(superseded.begin(), superseded.end(),
+                                   [](const unique_ptr<SceneFileTask>& task) { return task->isFinished(); }),
+                         superseded.end());
+        if (pending && pending->isFinished()) {
+            if (pending->hasSucceeded()) {
+                removeGenerations(oldest, pendingGeneration);
+                oldest = pendingGeneration;
+                error_code sizeError;
+                checkpointBytes = filesystem::file_size(checkpointName(pendingGeneration), sizeError);
+            }
+            else {
+                cerr << pending->getError() << endl;
+            }
+            pending.reset();
+        }
+        if (!pending && !failed && journal.is_open() && journalBytes >= max(minimumCompaction, checkpointBytes / 4))
+            checkpoint(scene, false);
+    }
+
+    bool isCheckpointing() const {
+        return pending != nullptr;
+    }
+};
@@ -0,0 +1,268 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "FileProgress.h"
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "ShapeFormat.h"
+
+using namespace std;
+
+// The whole word as a number; false for anything else, out of range included.
+template <typename Number>
+bool parseNumber(const string& word, Number& value) {
+    const char* end = word.data() + word.size();
+    from_chars_result result = from_chars(word.data(), end, value);
+    return result.ec == errc() && result.ptr == end;
+}
+
+// Streaming parser for the text scene format written by save().
+// Reads the file in large chunks, converts numbers in place with from_chars,
+// recognizes type tags by comparing bytes and builds nested Aggregates with an
+// explicit stack, so neither deep nesting nor long files cost extra allocations.
+class TextSceneParser {
+private:
+    static const size_t chunkSize = 1 << 20;
+    static const size_t maxTokenLength = 256;
+
+    ifstream file;
+    vector<char> buffer;
+    size_t position;
+    size_t end;
+    bool endOfFile;
+    size_t line;
+    size_t bytesRead;
+    size_t fileSize;
+
+    string error;
+    size_t errorLine;
+
+    const char* tokenBegin;
+    size_t tokenLength;
+
+    // Moves the unread tail to the front of the buffer and reads the next chunk.
+    bool refill() {
+        if (endOfFile)
+            return false;
+        size_t remaining = end - position;
+        memmove(buffer.data(), buffer.data() + position, remaining);
+        position = 0;
+        end = remaining;
+        file.read(buffer.data() + end, static_cast<streamsize>(buffer.size() - end));
+        size_t count = static_cast<size_t>(file.gcount());
+        end += count;
+        bytesRead += count;
+        if (count == 0 || !file)
+            endOfFile = true;
+        return count > 0;
+    }
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+    }
+
+    bool fail(const string& message) {
+        if (error.empty()) {
+            error = message;
+            errorLine = line;
+        }
+        return false;
+    }
+
+    bool nextToken() {
+        for (;;) {
+            while (position < end && isSpace(buffer[position])) {
+                if (buffer[position] == '\n')
+                    line++;
+                position++;
+            }
+            if (position < end)
+                break;
+            if (!refill())
+                return fail("unexpected end of file");
+        }
+        size_t tokenEnd = position;
+        for (;;) {
+            while (tokenEnd < end && !isSpace(buffer[tokenEnd]))
+                tokenEnd++;
+            if (tokenEnd < end || endOfFile)
+                break;
+            if (tokenEnd - position > maxTokenLength)
+                return fail("token too long");
+            size_t offset = tokenEnd - position;
+            refill();
+            tokenEnd = position + offset;
+        }
+        tokenBegin = buffer.data() + position;
+        tokenLength = tokenEnd - position;
+        position = tokenEnd;
+        return true;
+    }
+
+    string tokenText() const {
+        return string(tokenBegin, min(tokenLength, size_t(32)));
+    }
+
+    bool readFloat(float& value) {
+        if (!nextToken())
+            return false;
+        from_chars_result result = from_chars(tokenBegin, tokenBegin + tokenLength, value);
+        if (result.ec != errc() || result.ptr != tokenBegin + tokenLength)
+            return fail("expected a number, found '" + tokenText() + "'");
+        return true;
+    }
+
+    template <typename Integer>
+    bool readInteger(Integer& value) {
+        if (!nextToken())
+            return false;
+        from_chars_result result = from_chars(tokenBegin, tokenBegin + tokenLength, value);
+        if (result.ec != errc() || result.ptr != tokenBegin + tokenLength)
+            return fail("expected an integer, found '" + tokenText() + "'");
+        return true;
+    }
+
+    bool tokenIs(const char* tag, size_t length) const {
+        return tokenLength == length && memcmp(tokenBegin, tag, length) == 0;
+    }
+
+    GraphicObject* parseShape(Scene& scene, unsigned& childCount) {
+        childCount = 0;
+        if (!nextToken())
+            return nullptr;
+        GraphicObject* object = nullptr;
+        bool known = LeafShapes::visitTag(string_view(tokenBegin, tokenLength), [&](auto shape) {
+            using Shape = typename decltype(shape)::type;
+            float values[ShapeFormat<Shape>::valueCount];
+            sf::Uint32 color;
+            for (auto& value : values)
+                if (!readFloat(value))
+                    return;
+            if (!readInteger(color))
+                return;
+            Shape* created = scene.create<Shape>();
+            created->setValues(values, color);
+            object = created;
+        });
+        if (known)
+            return object;
+        if (tokenIs("Aggregate", 9)) {
+            if (!readInteger(childCount))
+                return nullptr;
+            return scene.create<Aggregate>();
+        }
+        fail("unknown shape type '" + tokenText() + "'");
+        return nullptr;
+    }
+
+public:
+    TextSceneParser() : position(0), end(0), endOfFile(true), line(1), bytesRead(0), fileSize(0), errorLine(0),
+        tokenBegin(nullptr), tokenLength(0) {}
+
+    bool open(const string& filename) {
+        file.close();
+        file.clear();
+        file.open(filename, ios::binary);
+        buffer.resize(chunkSize + maxTokenLength);
+        position = 0;
+        end = 0;
+        endOfFile = !file.is_open();
+        line = 1;
+        bytesRead = 0;
+        fileSize = 0;
+        error.clear();
+        errorLine = 0;
+        if (!file.is_open())
+            return fail("cannot open " + filename);
+        file.seekg(0, ios::end);
+        fileSize = static_cast<size_t>(file.tellg());
+        file.seekg(0, ios::beg);
+        return true;
+    }
+
+    // Parses the whole scene and appends the top-level objects to the scene.
+    // On error nothing is added and getError()/getErrorLine() describe the problem.
+    // Progress is counted in bytes; cancelling it fails the parse.
+    bool parse(Scene& scene, FileProgress* progress = nullptr) {
+        struct Frame {
+            Aggregate* aggregate;
+            unsigned remaining;
+        };
+        vector<Frame> stack;
+        vector<GraphicObject*> parsed;
+
+        auto discard = [&]() {
+            for (auto object : parsed)
+                scene.arena.destroy(object);
+            return false;
+        };
+
+        if (progress)
+            progress->total = fileSize;
+        size_t count = 0;
+
+        unsigned topRemaining;
+        if (!readInteger(topRemaining))
+            return false;
+        for (;;) {
+            if (progress && ++count % FileProgress::step == 0) {
+                progress->done = bytesRead;
+                if (progress->cancelled) {
+                    fail("cancelled");
+                    return discard();
+                }
+            }
+            Aggregate* parent = nullptr;
+            if (stack.empty()) {
+                if (topRemaining == 0)
+                    break;
+                topRemaining--;
+            }
+            else if (stack.back().remaining == 0) {
+                stack.pop_back();
+                continue;
+            }
+            else {
+                stack.back().remaining--;
+                parent = stack.back().aggregate;
+            }
+
+            unsigned childCount;
+            GraphicObject* object = parseShape(scene, childCount);
+            if (!object)
+                return discard();
+            if (parent)
+                parent->addObject(object);
+            else
+                parsed.push_back(object);
+
+            // Only an Aggregate reports children.
+            if (childCount > 0) {
+                Frame frame = { static_cast<Aggregate*>(object), childCount };
+                stack.push_back(frame);
+            }
+        }
+        scene.objects.insert(scene.objects.end(), parsed.begin(), parsed.end());
+        if (progress)
+            progress->done = fileSize;
+        return true;
+    }
+
+    const string& getError() const {
+        return error;
+    }
+
+    size_t getErrorLine() const {
+        return errorLine;
+    }
+
+    size_t getBytesRead() const {
+        return bytesRead;
+    }
+};
@@ -0,0 +1,167 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include "DrawOrder.h"
+#include "GraphicObject.h"
+#include "SpatialGrid.h"
+
+using namespace std;
+
+// Draws the whole scene with a single draw call.
+// Every leaf shape (including Aggregate children) is tessellated into one shared
+// vertex list; between frames only the ranges of shapes whose draw revision
+// (own revision plus enclosing Aggregate transforms) changed are
+// re-tessellated and re-uploaded to the vertex buffer. With a SpatialGrid only
+// shapes overlapping the current view are tessellated.
+// With a vertex buffer the vertices are only kept on the GPU; shapes cost the
+// CPU side nothing but their Range. Circles are tessellated for their size on
+// screen, so a zoom or resize re-tessellates everything.
+class SceneRenderer {
+private:
+    struct Range {
+        ShapeHandle handle;
+        unsigned revision;
+        size_t first;
+        size_t count;
+    };
+
+    // Scratch vertices above this size are freed after use rather than kept around.
+    static const size_t scratchLimit = 1 << 16;
+
+    vector<ShapeHandle> handles;
+    vector<Range> ranges;
+    // The whole vertex list, only without a vertex buffer.
+    vector<sf::Vertex> vertices;
+    vector<sf::Vertex> scratch;
+    size_t vertexCount;
+    // Screen pixels per world unit the vertices were built for.
+    float pixelScale;
+    sf::VertexBuffer buffer;
+    bool useBuffer;
+
+    bool layoutChanged() const {
+        if (handles.size() != ranges.size())
+            return true;
+        for (size_t i = 0; i < handles.size(); i++) {
+            if (handles[i] != ranges[i].handle)
+                return true;
+        }
+        return false;
+    }
+
+    void rebuild(const ShapeStore& store) {
+        vector<sf::Vertex>& target = useBuffer ? scratch : vertices;
+        target.clear();
+        ranges.clear();
+        for (auto handle : handles) {
+            unsigned index = store.indexOf(handle);
+            Range range;
+            range.handle = handle;
+            range.revision = store.drawRevision(index);
+            range.first = target.size();
+            store.appendVertices(index, target, pixelScale);
+            range.count = target.size() - range.first;
+            ranges.push_back(range);
+        }
+        vertexCount = target.size();
+        if (useBuffer) {
+            if (buffer.getVertexCount() < vertexCount)
+                buffer.create(vertexCount + vertexCount / 2);
+            if (vertexCount > 0)
+                buffer.update(scratch.data(), vertexCount, 0);
+            releaseScratch();
+        }
+    }
+
+    // Re-tessellates changed shapes in place; returns false if a shape changed its
+    // vertex count and the whole list has to be rebuilt. Changed shapes that are
+    // next to each other in the list are written with one update.
+    bool updateChanged(const ShapeStore& store) {
+        size_t pendingFirst = 0;
+        scratch.clear();
+        for (auto& range : ranges) {
+            unsigned index = store.indexOf(range.handle);
+            unsigned revision = store.drawRevision(index);
+            if (revision == range.revision)
+                continue;
+            if (!scratch.empty() && pendingFirst + scratch.size() != range.first)
+                upload(pendingFirst);
+            if (scratch.empty())
+                pendingFirst = range.first;
+            size_t before = scratch.size();
+            store.appendVertices(index, scratch, pixelScale);
+            if (scratch.size() - before != range.count)
+                return false;
+            range.revision = revision;
+        }
+        upload(pendingFirst);
+        releaseScratch();
+        return true;
+    }
+
+    // Writes the scratch vertices to the list starting at `first` and empties scratch.
+    void upload(size_t first) {
+        if (scratch.empty())
+            return;
+        if (useBuffer)
+            buffer.update(scratch.data(), scratch.size(), static_cast<unsigned int>(first));
+        else
+            copy(scratch.begin(), scratch.end(), vertices.begin() + first);
+        scratch.clear();
+    }
+
+    void releaseScratch() {
+        if (scratch.capacity() > scratchLimit)
+            vector<sf::Vertex>().swap(scratch);
+        else
+            scratch.clear();
+    }
+
+public:
+    SceneRenderer() : vertexCount(0), pixelScale(0.f), buffer(sf::Triangles, sf::VertexBuffer::Dynamic) {
+        useBuffer = sf::VertexBuffer::isAvailable();
+    }
+
+    void draw(sf::RenderWindow& window, const ShapeStore& store, const DrawOrder& order, SpatialGrid* grid = nullptr) {
+        const sf::View& view = window.getView();
+        handles.clear();
+        if (grid) {
+            sf::FloatRect area(view.getCenter().x - view.getSize().x / 2, view.getCenter().y - view.getSize().y / 2,
+                               view.getSize().x, view.getSize().y);
+            grid->queryRect(store, area, handles);
+            handles.erase(remove_if(handles.begin(), handles.end(), [&](ShapeHandle handle) {
+                return order.rootOf(handle) < 0;
+            }), handles.end());
+            order.sort(handles);
+        }
+        else {
+            handles = order.getHandles();
+        }
+
+        float scale = min(window.getSize().x / view.getSize().x, window.getSize().y / view.getSize().y);
+        bool rescaled = scale != pixelScale;
+        pixelScale = scale;
+
+        if (rescaled || layoutChanged() || !updateChanged(store))
+            rebuild(store);
+
+        if (vertexCount == 0)
+            return;
+        if (useBuffer)
+            window.draw(buffer, 0, vertexCount);
+        else
+            window.draw(vertices.data(), vertices.size(), sf::Triangles);
+    }
+
+    // Forgets the cached tessellation, e.g. when the scene is replaced.
+    void reset() {
+        ranges.clear();
+        vertices.clear();
+        vertexCount = 0;
+    }
+
+    size_t getVertexCount() const {
+        return vertexCount;
+    }
+};
@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string_view>
+#include "BinaryScene.h"
+#include "ShapeStore.h"
+
+using namespace std;
+
+class Circle;
+class Rectangle;
+class Triangle;
+
+// How a leaf shape type appears in scene files. A shape is written as
+// valueCount floats followed by its color: the text format puts the tag on
+// the first line, the position (the first two values) on the second and the
+// remaining values on the third, the binary format stores them in that order
+// in the shape's record. The shape classes, the text parser, the binary loader
+// and the writers are all generated from these declarations, so adding a shape
+// type means one specialization here and an entry in LeafShapes.
+template <typename Shape>
+struct ShapeFormat;
+
+template <>
+struct ShapeFormat<Circle> {
+    static constexpr string_view tag = "Circle";
+    static constexpr ShapeType type = ShapeType::Circle;
+    static constexpr size_t valueCount = 3;     // x, y, radius
+    using Record = CircleRecord;
+};
+
+template <>
+struct ShapeFormat<Rectangle> {
+    static constexpr string_view tag = "Rectangle";
+    static constexpr ShapeType type = ShapeType::Rectangle;
+    static constexpr size_t valueCount = 4;     // x, y, width, height
+    using Record = RectangleRecord;
+};
+
+template <>
+struct ShapeFormat<Triangle> {
+    static constexpr string_view tag = "Triangle";
+    static constexpr ShapeType type = ShapeType::Triangle;
+    static constexpr size_t valueCount = 8;     // x, y, then three points relative to (x, y)
+    using Record = TriangleRecord;
+};
+
+template <typename T>
+struct TypeTag {
+    using type = T;
+};
+
+// A closed set of shape types. The visit functions pick the type at compile
+// time from a run-time key and call visit(TypeTag<Shape>()) with it, so the
+// callers need neither virtual calls nor a hand-written chain per type.
+template <typename... Shapes>
+struct ShapeList {
+    // False when no shape type has the text tag.
+    template <typename Visitor>
+    static bool visitTag(string_view tag, Visitor&& visit) {
+        return ((ShapeFormat<Shapes>::tag == tag ? (visit(TypeTag<Shapes>()), true) : false) || ...);
+    }
+
+    // False when no shape type uses the binary node type.
+    template <typename Visitor>
+    static bool visitNode(BinaryNodeType node, Visitor&& visit) {
+        return ((ShapeFormat<Shapes>::Record::node == node ? (visit(TypeTag<Shapes>()), true) : false) || ...);
+    }
+};
+
+using LeafShapes = ShapeList<Circle, Rectangle, Triangle>;
+
+template <typename Shape>
+void writeShapeText(ostream& file, const float* values, uint32_t color) {
+    const size_t count = ShapeFormat<Shape>::valueCount;
+    file << ShapeFormat<Shape>::tag << "\n" << values[0] << " " << values[1] << "\n";
+    for (size_t k = 2; k < count; k++)
+        file << (k > 2 ? " " : "") << values[k];
+    file << "\n" << color << "\n";
+}
+
+// Records are laid out as the values followed by the color, so converting
+// is a copy; the assertions keep the record structs honest.
+template <typename Shape>
+typename ShapeFormat<Shape>::Record makeShapeRecord(const float* values, uint32_t color) {
+    using Record = typename ShapeFormat<Shape>::Record;
+    const size_t count = ShapeFormat<Shape>::valueCount;
+    static_assert(offsetof(Record, color) == count * sizeof(float) && sizeof(Record) == offsetof(Record, color) + sizeof(uint32_t),
+                  "shape record must hold the format's values followed by the color");
+    Record record;
+    memcpy(&record, values, count * sizeof(float));
+    record.color = color;
+    return record;
+}
+
+template <typename Shape>
+void readShapeRecord(const typename ShapeFormat<Shape>::Record& record, float* values) {
+    memcpy(values, &record, ShapeFormat<Shape>::valueCount * sizeof(float));
+}
@@ -0,0 +1,694 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "GeometryCache.h"
+#include "TaskScheduler.h"
+
+using namespace std;
+
+enum class ShapeType : unsigned char {
+    Circle,
+    Rectangle,
+    Triangle
+};
+
+// Stable reference to a shape in a ShapeStore. Stays valid while other shapes
+// are created or destroyed; the generation detects use after destroy.
+struct ShapeHandle {
+    unsigned slot = ~0u;
+    unsigned generation = 0;
+};
+
+inline bool operator==(ShapeHandle a, ShapeHandle b) {
+    return a.slot == b.slot && a.generation == b.generation;
+}
+
+inline bool operator!=(ShapeHandle a, ShapeHandle b) {
+    return !(a == b);
+}
+
+// Geometry changes recorded since the last ShapeStore::takeChanges call.
+struct ShapeChanges {
+    // Dense index ranges [first, last) whose bounds may have changed.
+    vector<pair<unsigned, unsigned>> ranges;
+    // Slots of destroyed shapes.
+    vector<unsigned> destroyedSlots;
+    // Set by clear(): everything has to be rebuilt.
+    bool reset = false;
+};
+
+// Translation and uniform scale of a transform group: world = local * scale + (x, y).
+struct GroupTransform {
+    float x = 0.f;
+    float y = 0.f;
+    float scale = 1.f;
+
+    sf::Vector2f apply(sf::Vector2f point) const {
+        return sf::Vector2f(point.x * scale + x, point.y * scale + y);
+    }
+};
+
+inline bool operator==(const GroupTransform& a, const GroupTransform& b) {
+    return a.x == b.x && a.y == b.y && a.scale == b.scale;
+}
+
+inline bool operator!=(const GroupTransform& a, const GroupTransform& b) {
+    return !(a == b);
+}
+
+// The transform that applies inner first, then outer.
+inline GroupTransform compose(const GroupTransform& outer, const GroupTransform& inner) {
+    GroupTransform result;
+    result.x = inner.x * outer.scale + outer.x;
+    result.y = inner.y * outer.scale + outer.y;
+    result.scale = inner.scale * outer.scale;
+    return result;
+}
+
+inline GroupTransform inverse(const GroupTransform& transform) {
+    GroupTransform result;
+    result.scale = 1.f / transform.scale;
+    result.x = -transform.x * result.scale;
+    result.y = -transform.y * result.scale;
+    return result;
+}
+
+// One shape in world coordinates, with the same meaning of the fields as the
+// store columns.
+struct ShapeGeometry {
+    ShapeType type;
+    float x;
+    float y;
+    float width;
+    float height;
+    sf::Vector2f points[3];
+};
+
+// Struct-of-arrays storage for every leaf shape of a scene.
+// Columns are indexed by a dense index; removing a shape moves the last one into
+// its place, so handles go through the slot table to find the current index.
+// Bulk operations take sorted index lists and run plain loops over contiguous
+// runs, which the compiler can vectorize.
+//
+// Geometry columns are local to the shape's transform group. Groups form a
+// tree (one per Aggregate, group 0 is the scene itself); moving or scaling a
+// group is O(1), plus logging the shapes under it when change tracking is on,
+// and world transforms are resolved lazily when shapes are read
+// through getGeometry, getBounds, contains or appendVertices.
+class ShapeStore {
+private:
+    struct TransformGroup {
+        unsigned parent;
+        GroupTransform local;
+        // Cached world transform, valid while resolvedEpoch == transformEpoch.
+        GroupTransform world;
+        unsigned resolvedEpoch;
+        // Bumped whenever the resolved world transform differs from the last one.
+        unsigned worldRevision;
+    };
+
+public:
+    vector<ShapeType> type;
+    vector<float> x;
+    vector<float> y;
+    // Circle: radius in both. Rectangle: size. Triangle: unused, see points.
+    vector<float> width;
+    vector<float> height;
+    vector<sf::Uint32> color;
+    vector<unsigned char> visible;
+    // Incremented on every change that affects the tessellated geometry.
+    vector<unsigned> revision;
+    // Three local points per shape, only meaningful for triangles.
+    vector<sf::Vector2f> points;
+    // Transform group the geometry is relative to.
+    vector<unsigned> group;
+
+private:
+    vector<unsigned> owner;
+    vector<unsigned> slotIndex;
+    vector<unsigned> slotGeneration;
+    vector<unsigned> freeSlots;
+    // Every generation handed out so far is below this, so handles issued
+    // after clear() never match older ones even though slots are reused.
+    unsigned generationBase = 0;
+    unsigned structureVersion = 0;
+    unsigned version = 0;
+
+    // Mutable: world transforms are a cache filled in by const readers.
+    mutable vector<TransformGroup> groups = vector<TransformGroup>(1, TransformGroup{ 0, GroupTransform(), GroupTransform(), 0, 0 });
+    vector<unsigned> freeGroups;
+    // Any group transform change invalidates every cached world transform at once;
+    // they are recomputed on the next read.
+    unsigned transformEpoch = 0;
+
+    bool trackChanges = false;
+    ShapeChanges changes;
+
+    // Column loops behind the range operations; they touch nothing but the
+    // columns of [first, last), so disjoint ranges may run concurrently.
+
+    void moveColumns(size_t first, size_t last, float dx, float dy) {
+        float* px = x.data();
+        float* py = y.data();
+        unsigned* rev = revision.data();
+        for (size_t i = first; i < last; i++) {
+            px[i] += dx;
+            py[i] += dy;
+            rev[i]++;
+        }
+    }
+
+    void colorColumns(size_t first, size_t last, sf::Uint32 value) {
+        sf::Uint32* pc = color.data();
+        unsigned char* pv = visible.data();
+        unsigned* rev = revision.data();
+        for (size_t i = first; i < last; i++) {
+            pc[i] = value;
+            pv[i] = 1;
+            rev[i]++;
+        }
+    }
+
+    void visibleColumns(size_t first, size_t last, bool value) {
+        unsigned char* pv = visible.data();
+        unsigned* rev = revision.data();
+        for (size_t i = first; i < last; i++) {
+            pv[i] = value ? 1 : 0;
+            rev[i]++;
+        }
+    }
+
+    void sizeColumns(size_t first, size_t last, float size) {
+        for (size_t i = first; i < last; i++) {
+            switch (type[i]) {
+            case ShapeType::Circle:
+                width[i] = size;
+                height[i] = size;
+                break;
+            case ShapeType::Rectangle: {
+                float longest = max(width[i], height[i]);
+                if (longest > 0.f) {
+                    width[i] = size * (width[i] / longest);
+                    height[i] = size * (height[i] / longest);
+                }
+                break;
+            }
+            case ShapeType::Triangle: {
+                sf::Vector2f* p = &points[i * 3];
+                float currentSize = sqrt(p[0].x * p[0].x + p[0].y * p[0].y);
+                if (currentSize > 0.f) {
+                    float scaleFactor = size / currentSize;
+                    for (int k = 0; k < 3; k++) {
+                        p[k].x *= scaleFactor;
+                        p[k].y *= scaleFactor;
+                    }
+                }
+                break;
+            }
+            }
+            revision[i]++;
+        }
+    }
+
+public:
+    ShapeHandle create(ShapeType shapeType) {
+        ShapeHandle handle;
+        if (!freeSlots.empty()) {
+            handle.slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            handle.slot = static_cast<unsigned>(slotIndex.size());
+            slotIndex.push_back(0);
+            slotGeneration.push_back(generationBase);
+        }
+        handle.generation = slotGeneration[handle.slot];
+        generationBase = max(generationBase, handle.generation + 1);
+        slotIndex[handle.slot] = static_cast<unsigned>(type.size());
+
+        type.push_back(shapeType);
+        x.push_back(0.f);
+        y.push_back(0.f);
+        width.push_back(0.f);
+        height.push_back(0.f);
+        color.push_back(sf::Color::White.toInteger());
+        visible.push_back(1);
+        revision.push_back(0);
+        points.resize(points.size() + 3);
+        group.push_back(0);
+        owner.push_back(handle.slot);
+        structureVersion++;
+        markChanged(type.size() - 1, type.size());
+        return handle;
+    }
+
+    void destroy(ShapeHandle handle) {
+        if (!isValid(handle))
+            return;
+        unsigned index = slotIndex[handle.slot];
+        unsigned last = static_cast<unsigned>(type.size() - 1);
+        if (index != last) {
+            type[index] = type[last];
+            x[index] = x[last];
+            y[index] = y[last];
+            width[index] = width[last];
+            height[index] = height[last];
+            color[index] = color[last];
+            visible[index] = visible[last];
+            revision[index] = revision[last] + 1;
+            copy(points.begin() + last * 3, points.begin() + last * 3 + 3, points.begin() + index * 3);
+            group[index] = group[last];
+            owner[index] = owner[last];
+            slotIndex[owner[index]] = index;
+            markChanged(index, index + 1);
+        }
+        type.pop_back();
+        x.pop_back();
+        y.pop_back();
+        width.pop_back();
+        height.pop_back();
+        color.pop_back();
+        visible.pop_back();
+        revision.pop_back();
+        points.resize(points.size() - 3);
+        group.pop_back();
+        owner.pop_back();
+
+        slotGeneration[handle.slot]++;
+        freeSlots.push_back(handle.slot);
+        structureVersion++;
+        version++;
+        if (trackChanges)
+            changes.destroyedSlots.push_back(handle.slot);
+    }
+
+    // Constant time: the columns hold trivial types and the slot table is dropped.
+    void clear() {
+        type.clear();
+        x.clear();
+        y.clear();
+        width.clear();
+        height.clear();
+        color.clear();
+        visible.clear();
+        revision.clear();
+        points.clear();
+        group.clear();
+        owner.clear();
+        slotIndex.clear();
+        slotGeneration.clear();
+        freeSlots.clear();
+        groups.resize(1);
+        freeGroups.clear();
+        transformEpoch++;
+        structureVersion++;
+        version++;
+        changes.ranges.clear();
+        changes.destroyedSlots.clear();
+        changes.reset = trackChanges;
+    }
+
+    bool isValid(ShapeHandle handle) const {
+        return handle.slot < slotGeneration.size() && slotGeneration[handle.slot] == handle.generation;
+    }
+
+    unsigned indexOf(ShapeHandle handle) const {
+        return slotIndex[handle.slot];
+    }
+
+    ShapeHandle handleAt(unsigned index) const {
+        ShapeHandle handle;
+        handle.slot = owner[index];
+        handle.generation = slotGeneration[handle.slot];
+        return handle;
+    }
+
+    ShapeHandle handleOfSlot(unsigned slot) const {
+        ShapeHandle handle;
+        handle.slot = slot;
+        handle.generation = slotGeneration[slot];
+        return handle;
+    }
+
+    size_t size() const {
+        return type.size();
+    }
+
+    // Geometry change log, used to keep spatial indices up to date without
+    // scanning the whole store. Off unless someone consumes it.
+    void setChangeTracking(bool enabled) {
+        trackChanges = enabled;
+        changes = ShapeChanges();
+        changes.reset = enabled;
+    }
+
+    void markChanged(size_t first, size_t last) {
+        version++;
+        if (!trackChanges)
+            return;
+        if (!changes.ranges.empty() && changes.ranges.back().second == first)
+            changes.ranges.back().second = static_cast<unsigned>(last);
+        else
+            changes.ranges.push_back(make_pair(static_cast<unsigned>(first), static_cast<unsigned>(last)));
+    }
+
+    void takeChanges(ShapeChanges& out) {
+        out.ranges.clear();
+        out.destroyedSlots.clear();
+        swap(out, changes);
+        changes.reset = false;
+    }
+
+    // Changes whenever shapes are created or destroyed (dense indices may move)
+    // or an Aggregate changes its children.
+    unsigned getStructureVersion() const {
+        return structureVersion;
+    }
+
+    void touchStructure() {
+        structureVersion++;
+        version++;
+    }
+
+    // Changes on every edit of the store, so a caller can tell whether
+    // anything needs to be redrawn.
+    unsigned getVersion() const {
+        return version;
+    }
+
+    // Transform groups.
+
+    unsigned createGroup(unsigned parent = 0) {
+        TransformGroup node = { parent, GroupTransform(), GroupTransform(), transformEpoch - 1, 0 };
+        if (!freeGroups.empty()) {
+            unsigned id = freeGroups.back();
+            freeGroups.pop_back();
+            // Keep the revision counting up, so a reused id never looks unchanged.
+            node.worldRevision = groups[id].worldRevision + 1;
+            groups[id] = node;
+            return id;
+        }
+        groups.push_back(node);
+        return static_cast<unsigned>(groups.size() - 1);
+    }
+
+    // The group must no longer have shapes or child groups.
+    void destroyGroup(unsigned id) {
+        if (id != 0 && id < groups.size())
+            freeGroups.push_back(id);
+    }
+
+    const GroupTransform& getGroupTransform(unsigned id) const {
+        return groups[id].local;
+    }
+
+    // shapes are the sorted dense indices of every shape under the group, at
+    // any depth; only they go to the change log.
+    template <typename Indices>
+    void setGroupTransform(unsigned id, const GroupTransform& local, const Indices& shapes) {
+        if (id == 0 || groups[id].local == local)
+            return;
+        groups[id].local = local;
+        transformEpoch++;
+        version++;
+        if (trackChanges)
+            forEachRun(shapes, [&](size_t first, size_t last) { markChanged(first, last); });
+    }
+
+    // Moves the group by (dx, dy) in world units.
+    template <typename Indices>
+    void moveGroup(unsigned id, float dx, float dy, const Indices& shapes) {
+        GroupTransform local = groups[id].local;
+        float parentScale = worldTransform(groups[id].parent).scale;
+        if (parentScale == 0.f)
+            return;
+        local.x += dx / parentScale;
+        local.y += dy / parentScale;
+        setGroupTransform(id, local, shapes);
+    }
+
+    // Re-parents a group without changing where its contents end up, so no
+    // bounds change and nothing is logged.
+    void setGroupParent(unsigned id, unsigned parent) {
+        if (id == 0 || groups[id].parent == parent)
+            return;
+        GroupTransform world = worldTransform(id);
+        groups[id].parent = parent;
+        groups[id].local = compose(inverse(worldTransform(parent)), world);
+        transformEpoch++;
+        version++;
+    }
+
+    const GroupTransform& worldTransform(unsigned id) const {
+        TransformGroup& node = groups[id];
+        if (id == 0 || node.resolvedEpoch == transformEpoch)
+            return node.world;
+        GroupTransform world = compose(worldTransform(node.parent), node.local);
+        if (world != node.world) {
+            node.world = world;
+            node.worldRevision++;
+        }
+        node.resolvedEpoch = transformEpoch;
+        return node.world;
+    }
+
+    // Moves a shape into another group, converting its geometry so it stays
+    // where it is on screen.
+    void setGroup(unsigned index, unsigned id) {
+        if (group[index] == id)
+            return;
+        GroupTransform change = compose(inverse(worldTransform(id)), worldTransform(group[index]));
+        sf::Vector2f position = change.apply(sf::Vector2f(x[index], y[index]));
+        x[index] = position.x;
+        y[index] = position.y;
+        width[index] *= change.scale;
+        height[index] *= change.scale;
+        for (int k = 0; k < 3; k++)
+            points[index * 3 + k] *= change.scale;
+        group[index] = id;
+        revision[index]++;
+        markChanged(index, index + 1);
+    }
+
+    // Changes whenever the shape or any transform above it changes; what
+    // caches of world geometry compare against.
+    unsigned drawRevision(unsigned index) const {
+        unsigned id = group[index];
+        if (id == 0)
+            return revision[index];
+        worldTransform(id);
+        return revision[index] + groups[id].worldRevision;
+    }
+
+    ShapeGeometry getGeometry(unsigned index) const {
+        ShapeGeometry geometry;
+        geometry.type = type[index];
+        const sf::Vector2f* p = &points[index * 3];
+        unsigned id = group[index];
+        if (id == 0) {
+            geometry.x = x[index];
+            geometry.y = y[index];
+            geometry.width = width[index];
+            geometry.height = height[index];
+            copy(p, p + 3, geometry.points);
+            return geometry;
+        }
+        const GroupTransform& world = worldTransform(id);
+        sf::Vector2f position = world.apply(sf::Vector2f(x[index], y[index]));
+        geometry.x = position.x;
+        geometry.y = position.y;
+        geometry.width = width[index] * world.scale;
+        geometry.height = height[index] * world.scale;
+        for (int k = 0; k < 3; k++)
+            geometry.points[k] = p[k] * world.scale;
+        return geometry;
+    }
+
+    sf::Color getFillColor(unsigned index) const {
+        return visible[index] ? sf::Color(color[index]) : sf::Color::Transparent;
+    }
+
+    // Range kernels over [first, last).
+
+    void moveRange(size_t first, size_t last, float dx, float dy) {
+        moveColumns(first, last, dx, dy);
+        markChanged(first, last);
+    }
+
+    void changeColorRange(size_t first, size_t last, sf::Color newColor) {
+        colorColumns(first, last, newColor.toInteger());
+        version++;
+    }
+
+    void setVisibleRange(size_t first, size_t last, bool value) {
+        visibleColumns(first, last, value);
+        version++;
+    }
+
+    void changeSizeRange(size_t first, size_t last, float size) {
+        sizeColumns(first, last, size);
+        markChanged(first, last);
+    }
+
+    // Bulk operations over a sorted list of dense indices, split into contiguous runs.
+    // Lists longer than parallelGrain are split into chunks for the shared
+    // TaskScheduler; the columns of different chunks never overlap, and the
+    // change log and version are updated afterwards on the calling thread.
+
+    static constexpr size_t parallelGrain = 32768;
+
+    template <typename Kernel>
+    static void forEachRun(const unsigned* indices, size_t count, Kernel kernel) {
+        size_t i = 0;
+        while (i < count) {
+            size_t first = indices[i];
+            size_t last = first + 1;
+            i++;
+            while (i < count && indices[i] == last) {
+                last++;
+                i++;
+            }
+            kernel(first, last);
+        }
+    }
+
+    template <typename Indices, typename Kernel>
+    static void forEachRun(const Indices& indices, Kernel kernel) {
+        forEachRun(indices.data(), indices.size(), kernel);
+    }
+
+    template <typename Indices, typename Kernel>
+    static void forEachRunParallel(const Indices& indices, Kernel kernel) {
+        const unsigned* data = indices.data();
+        TaskScheduler::shared().parallelFor(0, indices.size(), parallelGrain, [&](size_t first, size_t last) {
+            forEachRun(data + first, last - first, kernel);
+        });
+    }
+
+    template <typename Indices>
+    void move(const Indices& indices, float dx, float dy) {
+        forEachRunParallel(indices, [&](size_t first, size_t last) { moveColumns(first, last, dx, dy); });
+        forEachRun(indices, [&](size_t first, size_t last) { markChanged(first, last); });
+    }
+
+    template <typename Indices>
+    void changeColor(const Indices& indices, sf::Color newColor) {
+        sf::Uint32 value = newColor.toInteger();
+        forEachRunParallel(indices, [&](size_t first, size_t last) { colorColumns(first, last, value); });
+        version++;
+    }
+
+    template <typename Indices>
+    void setVisible(const Indices& indices, bool value) {
+        forEachRunParallel(indices, [&](size_t first, size_t last) { visibleColumns(first, last, value); });
+        version++;
+    }
+
+    template <typename Indices>
+    void changeSize(const Indices& indices, float size) {
+        forEachRunParallel(indices, [&](size_t first, size_t last) { sizeColumns(first, last, size); });
+        forEachRun(indices, [&](size_t first, size_t last) { markChanged(first, last); });
+    }
+
+    // Resolves every group's world transform, so that readers on several
+    // threads find the cache filled and never write to it.
+    void resolveTransforms() const {
+        for (unsigned id = 1; id < groups.size(); id++)
+            worldTransform(id);
+    }
+
+    sf::FloatRect getBounds(unsigned index) const {
+        return getBounds(getGeometry(index));
+    }
+
+    static sf::FloatRect getBounds(const ShapeGeometry& shape) {
+        float left = shape.x;
+        float top = shape.y;
+        switch (shape.type) {
+        case ShapeType::Circle:
+            return sf::FloatRect(left, top, shape.width * 2.f, shape.height * 2.f);
+        case ShapeType::Rectangle:
+            return sf::FloatRect(min(left, left + shape.width), min(top, top + shape.height),
+                                 abs(shape.width), abs(shape.height));
+        case ShapeType::Triangle: {
+            const sf::Vector2f* p = shape.points;
+            float minX = min(p[0].x, min(p[1].x, p[2].x));
+            float minY = min(p[0].y, min(p[1].y, p[2].y));
+            float maxX = max(p[0].x, max(p[1].x, p[2].x));
+            float maxY = max(p[0].y, max(p[1].y, p[2].y));
+            return sf::FloatRect(left + minX, top + minY, maxX - minX, maxY - minY);
+        }
+        }
+        return sf::FloatRect();
+    }
+
+    // Exact point-in-shape test in world coordinates.
+    bool contains(unsigned index, float px, float py) const {
+        ShapeGeometry shape = getGeometry(index);
+        switch (shape.type) {
+        case ShapeType::Circle: {
+            float radius = shape.width;
+            float dx = px - (shape.x + radius);
+            float dy = py - (shape.y + radius);
+            return dx * dx + dy * dy <= radius * radius;
+        }
+        case ShapeType::Rectangle:
+            return getBounds(shape).contains(px, py);
+        case ShapeType::Triangle: {
+            const sf::Vector2f* p = shape.points;
+            float lx = px - shape.x;
+            float ly = py - shape.y;
+            float d0 = (p[1].x - p[0].x) * (ly - p[0].y) - (p[1].y - p[0].y) * (lx - p[0].x);
+            float d1 = (p[2].x - p[1].x) * (ly - p[1].y) - (p[2].y - p[1].y) * (lx - p[1].x);
+            float d2 = (p[0].x - p[2].x) * (ly - p[2].y) - (p[0].y - p[2].y) * (lx - p[2].x);
+            bool negative = d0 < 0 || d1 < 0 || d2 < 0;
+            bool positive = d0 > 0 || d1 > 0 || d2 > 0;
+            return !(negative && positive);
+        }
+        }
+        return false;
+    }
+
+    // Appends one shape as sf::Triangles vertices in world coordinates.
+    // With pixelScale (screen pixels per world unit) circles are tessellated
+    // for their size on screen; 0 keeps the fixed circlePointCount outline.
+    void appendVertices(unsigned index, vector<sf::Vertex>& vertices, float pixelScale = 0.f) const {
+        sf::Color fill = getFillColor(index);
+        ShapeGeometry shape = getGeometry(index);
+        float px = shape.x;
+        float py = shape.y;
+        switch (shape.type) {
+        case ShapeType::Circle: {
+            float radius = shape.width;
+            sf::Vector2f center(px + radius, py + radius);
+            const vector<sf::Vector2f>& unit = pixelScale > 0.f ?
+                GeometryCache::unitCircle(GeometryCache::circleLevel(abs(radius) * pixelScale)) : GeometryCache::unitCircle();
+            for (auto corner : unit)
+                vertices.push_back(sf::Vertex(sf::Vector2f(center.x + corner.x * radius, center.y + corner.y * radius), fill));
+            break;
+        }
+        case ShapeType::Rectangle: {
+            sf::Vector2f a(px, py);
+            sf::Vector2f b(px + shape.width, py);
+            sf::Vector2f c(px + shape.width, py + shape.height);
+            sf::Vector2f d(px, py + shape.height);
+            vertices.push_back(sf::Vertex(a, fill));
+            vertices.push_back(sf::Vertex(b, fill));
+            vertices.push_back(sf::Vertex(c, fill));
+            vertices.push_back(sf::Vertex(a, fill));
+            vertices.push_back(sf::Vertex(c, fill));
+            vertices.push_back(sf::Vertex(d, fill));
+            break;
+        }
+        case ShapeType::Triangle: {
+            const sf::Vector2f* p = shape.points;
+            for (int k = 0; k < 3; k++)
+                vertices.push_back(sf::Vertex(sf::Vector2f(px + p[k].x, py + p[k].y), fill));
+            break;
+        }
+        }
+    }
+};
@@ -0,0 +1,186 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "RenderBackend.h"
+#include "ShapeStore.h"
+
+using namespace std;
+
+// Alpha-blends a color over an RGBA pixel the way SFML's default BlendAlpha does.
+inline void blendPixel(sf::Uint8* pixel, sf::Color color) {
+    if (color.a == 255) {
+        pixel[0] = color.r;
+        pixel[1] = color.g;
+        pixel[2] = color.b;
+        pixel[3] = 255;
+        return;
+    }
+    unsigned a = color.a;
+    unsigned inverse = 255 - a;
+    pixel[0] = static_cast<sf::Uint8>((color.r * a + pixel[0] * inverse + 127) / 255);
+    pixel[1] = static_cast<sf::Uint8>((color.g * a + pixel[1] * inverse + 127) / 255);
+    pixel[2] = static_cast<sf::Uint8>((color.b * a + pixel[2] * inverse + 127) / 255);
+    pixel[3] = static_cast<sf::Uint8>((255 * a + pixel[3] * inverse + 127) / 255);
+}
+
+// Writes an RGBA8 image. .ppm is written directly; anything else goes through
+// sf::Image (PNG, BMP, TGA, JPG), which needs no display either.
+inline bool saveImage(const string& filename, unsigned width, unsigned height, const sf::Uint8* pixels) {
+    if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".ppm") == 0) {
+        ofstream file(filename, ios::binary);
+        if (!file.is_open())
+            return false;
+        file << "P6\n" << width << " " << height << "\n255\n";
+        vector<char> row(static_cast<size_t>(width) * 3);
+        for (unsigned y = 0; y < height; y++) {
+            const sf::Uint8* pixel = pixels + static_cast<size_t>(y) * width * 4;
+            for (unsigned x = 0; x < width; x++) {
+                row[x * 3] = static_cast<char>(pixel[x * 4]);
+                row[x * 3 + 1] = static_cast<char>(pixel[x * 4 + 1]);
+                row[x * 3 + 2] = static_cast<char>(pixel[x * 4 + 2]);
+            }
+            file.write(row.data(), static_cast<streamsize>(row.size()));
+        }
+        file.flush();
+        return file.good();
+    }
+    sf::Image image;
+    image.create(width, height, pixels);
+    return image.saveToFile(filename);
+}
+
+// CPU renderer into an RGBA8 framebuffer; needs neither a display nor a GPU.
+// A pixel is covered when its center lies inside the shape. Circles are filled
+// exactly rather than as the 30-gon the window renderer uses.
+class SoftwareRasterizer : public RenderBackend {
+private:
+    int width;
+    int height;
+    vector<sf::Uint8> pixels;
+
+    void fillSpan(int y, int x0, int x1, sf::Color color) {
+        if (y < 0 || y >= height)
+            return;
+        x0 = max(x0, 0);
+        x1 = min(x1, width - 1);
+        if (x0 > x1)
+            return;
+        sf::Uint8* pixel = &pixels[(static_cast<size_t>(y) * width + x0) * 4];
+        for (int x = x0; x <= x1; x++, pixel += 4)
+            blendPixel(pixel, color);
+    }
+
+    // Tests every pixel center in the bounding box, the same arithmetic as
+    // TiledRasterizer, so the two agree on edge pixels.
+    void fillCircle(float left, float top, float radius, sf::Color color) {
+        float cx = left + radius;
+        float cy = top + radius;
+        int x0 = max(static_cast<int>(floor(cx - radius)), 0);
+        int x1 = min(static_cast<int>(ceil(cx + radius)), width - 1);
+        int y0 = max(static_cast<int>(floor(cy - radius)), 0);
+        int y1 = min(static_cast<int>(ceil(cy + radius)), height - 1);
+        if (x0 > x1 || y0 > y1)
+            return;
+        for (int y = y0; y <= y1; y++) {
+            float dy = y + 0.5f - cy;
+            sf::Uint8* pixel = &pixels[(static_cast<size_t>(y) * width + x0) * 4];
+            for (int x = x0; x <= x1; x++, pixel += 4) {
+                float dx = x + 0.5f - cx;
+                if (dx * dx + dy * dy <= radius * radius)
+                    blendPixel(pixel, color);
+            }
+        }
+    }
+
+    void fillRectangle(const sf::FloatRect& rect, sf::Color color) {
+        int x0 = static_cast<int>(ceil(rect.left - 0.5f));
+        int x1 = static_cast<int>(ceil(rect.left + rect.width - 0.5f)) - 1;
+        int y0 = max(static_cast<int>(ceil(rect.top - 0.5f)), 0);
+        int y1 = min(static_cast<int>(ceil(rect.top + rect.height - 0.5f)) - 1, height - 1);
+        for (int y = y0; y <= y1; y++)
+            fillSpan(y, x0, x1, color);
+    }
+
+    void fillTriangle(sf::Vector2f a, sf::Vector2f b, sf::Vector2f c, sf::Color color) {
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (area == 0.f)
+            return;
+        if (area < 0.f)
+            swap(b, c);
+        int x0 = max(static_cast<int>(floor(min(a.x, min(b.x, c.x)))), 0);
+        int x1 = min(static_cast<int>(ceil(max(a.x, max(b.x, c.x)))), width - 1);
+        int y0 = max(static_cast<int>(floor(min(a.y, min(b.y, c.y)))), 0);
+        int y1 = min(static_cast<int>(ceil(max(a.y, max(b.y, c.y)))), height - 1);
+        if (x0 > x1 || y0 > y1)
+            return;
+        for (int y = y0; y <= y1; y++) {
+            float py = y + 0.5f;
+            sf::Uint8* pixel = &pixels[(static_cast<size_t>(y) * width + x0) * 4];
+            for (int x = x0; x <= x1; x++, pixel += 4) {
+                float px = x + 0.5f;
+                float e0 = (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+                float e1 = (c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x);
+                float e2 = (a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x);
+                if (e0 >= 0.f && e1 >= 0.f && e2 >= 0.f)
+                    blendPixel(pixel, color);
+            }
+        }
+    }
+
+public:
+    SoftwareRasterizer(unsigned width, unsigned height)
+        : width(static_cast<int>(width)), height(static_cast<int>(height)), pixels(static_cast<size_t>(width) * height * 4, 0) {}
+
+    void clear(sf::Color color) override {
+        for (size_t i = 0; i < pixels.size(); i += 4) {
+            pixels[i] = color.r;
+            pixels[i + 1] = color.g;
+            pixels[i + 2] = color.b;
+            pixels[i + 3] = color.a;
+        }
+    }
+
+    void drawShape(const ShapeStore& store, unsigned index) override {
+        sf::Color color = store.getFillColor(index);
+        if (color.a == 0)
+            return;
+        ShapeGeometry shape = store.getGeometry(index);
+        switch (shape.type) {
+        case ShapeType::Circle:
+            fillCircle(shape.x, shape.y, shape.width, color);
+            break;
+        case ShapeType::Rectangle:
+            fillRectangle(ShapeStore::getBounds(shape), color);
+            break;
+        case ShapeType::Triangle: {
+            const sf::Vector2f* p = shape.points;
+            sf::Vector2f origin(shape.x, shape.y);
+            fillTriangle(origin + p[0], origin + p[1], origin + p[2], color);
+            break;
+        }
+        }
+    }
+
+    void display() override {}
+
+    unsigned getWidth() const {
+        return static_cast<unsigned>(width);
+    }
+
+    unsigned getHeight() const {
+        return static_cast<unsigned>(height);
+    }
+
+    const vector<sf::Uint8>& getPixels() const {
+        return pixels;
+    }
+
+    bool save(const string& filename) const {
+        return saveImage(filename, getWidth(), getHeight(), pixels.data());
+    }
+};
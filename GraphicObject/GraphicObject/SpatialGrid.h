@@ -0,0 +1,222 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "ShapeStore.h"
+
+using namespace std;
+
+// Uniform grid over the bounding boxes of all shapes in a ShapeStore.
+// Kept up to date incrementally from the store's geometry change log, so a
+// frame only pays for shapes that moved or were resized. Shapes covering too
+// many cells go to a separate list that every query checks.
+class SpatialGrid {
+private:
+    static const int maxCellsPerShape = 64;
+
+    struct Entry {
+        sf::FloatRect bounds;
+        int minX, minY, maxX, maxY;
+        bool inserted;
+        bool oversized;
+    };
+
+    float cellSize;
+    unordered_map<uint64_t, vector<unsigned>> cells;
+    vector<Entry> entries;
+    vector<unsigned> oversized;
+    vector<unsigned> stamps;
+    unsigned stamp;
+    ShapeChanges changes;
+
+    static uint64_t cellKey(int cx, int cy) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(cx)) << 32) | static_cast<uint32_t>(cy);
+    }
+
+    int cellOf(float value) const {
+        float cell = floor(value / cellSize);
+        if (!(cell > -1e9f))
+            return -1000000000;
+        if (!(cell < 1e9f))
+            return 1000000000;
+        return static_cast<int>(cell);
+    }
+
+    static int64_t cellCount(int minX, int minY, int maxX, int maxY) {
+        return (static_cast<int64_t>(maxX) - minX + 1) * (static_cast<int64_t>(maxY) - minY + 1);
+    }
+
+    static void eraseValue(vector<unsigned>& values, unsigned value) {
+        for (size_t i = 0; i < values.size(); i++) {
+            if (values[i] == value) {
+                values[i] = values.back();
+                values.pop_back();
+                return;
+            }
+        }
+    }
+
+    void remove(unsigned slot) {
+        if (slot >= entries.size() || !entries[slot].inserted)
+            return;
+        Entry& entry = entries[slot];
+        if (entry.oversized) {
+            eraseValue(oversized, slot);
+        }
+        else {
+            for (int cy = entry.minY; cy <= entry.maxY; cy++) {
+                for (int cx = entry.minX; cx <= entry.maxX; cx++) {
+                    auto cell = cells.find(cellKey(cx, cy));
+                    if (cell == cells.end())
+                        continue;
+                    eraseValue(cell->second, slot);
+                    if (cell->second.empty())
+                        cells.erase(cell);
+                }
+            }
+        }
+        entry.inserted = false;
+    }
+
+    void insert(const ShapeStore& store, unsigned index) {
+        insert(store.handleAt(index).slot, store.getBounds(index));
+    }
+
+    void insert(unsigned slot, const sf::FloatRect& bounds) {
+        if (slot >= entries.size()) {
+            Entry empty = {};
+            entries.resize(slot + 1, empty);
+            stamps.resize(slot + 1, 0);
+        }
+        Entry& entry = entries[slot];
+        int minX = cellOf(bounds.left);
+        int minY = cellOf(bounds.top);
+        int maxX = cellOf(bounds.left + bounds.width);
+        int maxY = cellOf(bounds.top + bounds.height);
+        if (entry.inserted && !entry.oversized &&
+            minX == entry.minX && minY == entry.minY && maxX == entry.maxX && maxY == entry.maxY) {
+            entry.bounds = bounds;
+            return;
+        }
+        remove(slot);
+        entry.bounds = bounds;
+        entry.minX = minX;
+        entry.minY = minY;
+        entry.maxX = maxX;
+        entry.maxY = maxY;
+        entry.inserted = true;
+        entry.oversized = cellCount(minX, minY, maxX, maxY) > maxCellsPerShape;
+        if (entry.oversized) {
+            oversized.push_back(slot);
+            return;
+        }
+        for (int cy = minY; cy <= maxY; cy++) {
+            for (int cx = minX; cx <= maxX; cx++)
+                cells[cellKey(cx, cy)].push_back(slot);
+        }
+    }
+
+    // Calls visit(slot) once for every shape whose cells overlap the rectangle.
+    template <typename Visitor>
+    void forEachCandidate(const sf::FloatRect& area, Visitor visit) {
+        stamp++;
+        if (stamp == 0) {
+            fill(stamps.begin(), stamps.end(), 0);
+            stamp = 1;
+        }
+        int minX = cellOf(area.left);
+        int minY = cellOf(area.top);
+        int maxX = cellOf(area.left + area.width);
+        int maxY = cellOf(area.top + area.height);
+        if (cellCount(minX, minY, maxX, maxY) > static_cast<int64_t>(cells.size())) {
+            for (auto& cell : cells) {
+                int cx = static_cast<int>(static_cast<uint32_t>(cell.first >> 32));
+                int cy = static_cast<int>(static_cast<uint32_t>(cell.first));
+                if (cx < minX || cx > maxX || cy < minY || cy > maxY)
+                    continue;
+                for (auto slot : cell.second) {
+                    if (stamps[slot] != stamp) {
+                        stamps[slot] = stamp;
+                        visit(slot);
+                    }
+                }
+            }
+        }
+        else {
+            for (int cy = minY; cy <= maxY; cy++) {
+                for (int cx = minX; cx <= maxX; cx++) {
+                    auto cell = cells.find(cellKey(cx, cy));
+                    if (cell == cells.end())
+                        continue;
+                    for (auto slot : cell->second) {
+                        if (stamps[slot] != stamp) {
+                            stamps[slot] = stamp;
+                            visit(slot);
+                        }
+                    }
+                }
+            }
+        }
+        for (auto slot : oversized)
+            visit(slot);
+    }
+
+    static bool overlaps(const sf::FloatRect& a, const sf::FloatRect& b) {
+        return a.left <= b.left + b.width && b.left <= a.left + a.width &&
+            a.top <= b.top + b.height && b.top <= a.top + a.height;
+    }
+
+public:
+    SpatialGrid(float cellSize = 64.f) : cellSize(cellSize), stamp(0) {}
+
+    void clear() {
+        cells.clear();
+        entries.clear();
+        oversized.clear();
+        stamps.clear();
+        stamp = 0;
+    }
+
+    // Applies the geometry changes recorded by the store since the last update.
+    // The store must have change tracking enabled. Moving or scaling an
+    // Aggregate logs the shapes under it, so the cost is linear in those.
+    void update(ShapeStore& store) {
+        store.takeChanges(changes);
+        if (changes.reset) {
+            clear();
+            for (unsigned i = 0; i < store.size(); i++)
+                insert(store, i);
+            return;
+        }
+        for (auto slot : changes.destroyedSlots)
+            remove(slot);
+        for (auto& range : changes.ranges) {
+            unsigned last = min(range.second, static_cast<unsigned>(store.size()));
+            for (unsigned i = range.first; i < last; i++)
+                insert(store, i);
+        }
+    }
+
+    // Appends every shape whose bounding box intersects the area.
+    void queryRect(const ShapeStore& store, const sf::FloatRect& area, vector<ShapeHandle>& result) {
+        forEachCandidate(area, [&](unsigned slot) {
+            if (overlaps(entries[slot].bounds, area))
+                result.push_back(store.handleOfSlot(slot));
+        });
+    }
+
+    // Appends every shape that contains the point (exact shape test).
+    void queryPoint(const ShapeStore& store, float x, float y, vector<ShapeHandle>& result) {
+        sf::FloatRect area(x, y, 0.f, 0.f);
+        forEachCandidate(area, [&](unsigned slot) {
+            if (!overlaps(entries[slot].bounds, area))
+                return;
+            ShapeHandle handle = store.handleOfSlot(slot);
+            if (store.contains(store.indexOf(handle), x, y))
+                result.push_back(handle);
+        });
+    }
+};
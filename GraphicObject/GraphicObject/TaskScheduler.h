@@ -0,0 +1,215 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Work-stealing thread pool. Every worker has its own deque: it pushes and
+// pops at the back, idle workers steal from the front of the others. Tasks
+// submitted from outside the pool go to a shared queue that is stolen from
+// the same way. Threads waiting for a TaskGroup run queued tasks meanwhile,
+// so parallel work may be nested without starving the pool.
+class TaskScheduler {
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    // queues[0..threads) belong to the workers; the last one takes outside submissions.
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> threads;
+    mutex sleepLock;
+    condition_variable wake;
+    atomic<size_t> queued;
+    bool stopping;
+
+    static int& currentWorker() {
+        static thread_local int worker = -1;
+        return worker;
+    }
+
+    bool popFrom(Queue& queue, bool back, function<void()>& task) {
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+            return false;
+        if (back) {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+
+    bool take(function<void()>& task) {
+        int self = currentWorker();
+        if (self >= 0 && popFrom(*queues[self], true, task))
+            return true;
+        size_t count = queues.size();
+        size_t start = self >= 0 ? static_cast<size_t>(self) + 1 : 0;
+        for (size_t k = 0; k < count; k++) {
+            size_t victim = (start + k) % count;
+            if (static_cast<int>(victim) != self && popFrom(*queues[victim], false, task))
+                return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int index) {
+        currentWorker() = index;
+        function<void()> task;
+        while (true) {
+            if (take(task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+    void start(unsigned count) {
+        stopping = false;
+        queues.clear();
+        for (unsigned i = 0; i <= count; i++)
+            queues.emplace_back(new Queue());
+        for (unsigned i = 0; i < count; i++)
+            threads.emplace_back(&TaskScheduler::workerLoop, this, static_cast<int>(i));
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : threads)
+            worker.join();
+        threads.clear();
+    }
+
+public:
+    // Zero threads means the calling thread runs everything.
+    TaskScheduler(unsigned threadCount = thread::hardware_concurrency()) : queued(0), stopping(false) {
+        start(threadCount > 1 ? threadCount : 0);
+    }
+
+    ~TaskScheduler() {
+        stop();
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    // Pool shared by the bulk operations of every scene.
+    static TaskScheduler& shared() {
+        static TaskScheduler scheduler;
+        return scheduler;
+    }
+
+    // Restarts the pool with a different size. No tasks may be running.
+    void setThreadCount(unsigned count) {
+        stop();
+        start(count > 1 ? count : 0);
+    }
+
+    // Threads that take part in parallel work, the caller included.
+    unsigned getThreadCount() const {
+        return max(static_cast<unsigned>(threads.size()), 1u);
+    }
+
+    void submit(function<void()> task) {
+        int self = currentWorker();
+        Queue& queue = self >= 0 ? *queues[self] : *queues.back();
+        {
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(move(task));
+            queued++;
+        }
+        // Taking sleepLock orders the notify after a worker's predicate check.
+        { lock_guard<mutex> guard(sleepLock); }
+        wake.notify_one();
+    }
+
+    // Runs one queued task on the calling thread; false if there was none.
+    bool runOne() {
+        function<void()> task;
+        if (!take(task))
+            return false;
+        task();
+        return true;
+    }
+
+    // Calls body(first, last) over [begin, end) split into chunks of at least
+    // `grain` items. Ranges up to `grain` run inline without touching the pool.
+    template <typename Body>
+    void parallelFor(size_t begin, size_t end, size_t grain, Body body);
+};
+
+// A set of tasks to wait for. wait() helps with queued work instead of blocking.
+class TaskGroup {
+private:
+    TaskScheduler& scheduler;
+    atomic<size_t> pending;
+
+public:
+    TaskGroup(TaskScheduler& scheduler) : scheduler(scheduler), pending(0) {}
+
+    ~TaskGroup() {
+        wait();
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    template <typename Task>
+    void run(Task task) {
+        pending++;
+        scheduler.submit([this, task] {
+            task();
+            pending--;
+        });
+    }
+
+    void wait() {
+        while (pending > 0) {
+            if (!scheduler.runOne())
+                this_thread::yield();
+        }
+    }
+};
+
+template <typename Body>
+void TaskScheduler::parallelFor(size_t begin, size_t end, size_t grain, Body body) {
+    grain = max<size_t>(grain, 1);
+    if (end - begin <= grain || threads.empty()) {
+        if (end > begin)
+            body(begin, end);
+        return;
+    }
+    // A few chunks per thread, so stealing can even out uneven chunks.
+    size_t chunks = min((end - begin + grain - 1) / grain, static_cast<size_t>(getThreadCount()) * 4);
+    size_t size = (end - begin + chunks - 1) / chunks;
+    TaskGroup group(*this);
+    for (size_t first = begin + size; first < end; first += size) {
+        size_t last = min(first + size, end);
+        group.run([&body, first, last] { body(first, last); });
+    }
+    body(begin, min(begin + size, end));
+    group.wait();
+}
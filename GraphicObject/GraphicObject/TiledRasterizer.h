@@ -0,0 +1,376 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "RenderBackend.h"
+#include "ShapeStore.h"
+#include "SoftwareRasterizer.h"
+#include "TaskScheduler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TILED_RASTERIZER_SSE2 1
+#endif
+
+using namespace std;
+
+// Multithreaded CPU renderer for large scenes. Shapes handed to drawShape are
+// only recorded; display() bins them by bounding box into 64x64 screen tiles
+// and rasterizes the tiles in parallel on a TaskScheduler, the shared one
+// unless told otherwise. Every tile walks its shapes in the
+// order they were drawn, so the result matches SoftwareRasterizer pixel for
+// pixel (same pixel-center coverage rule and blending); --render --reference
+// checks that.
+class TiledRasterizer : public RenderBackend {
+private:
+    static const int tileSize = 64;
+
+    // Shape snapshot taken at drawShape time, so binning and rasterization
+    // never touch the store from worker threads.
+    struct Primitive {
+        ShapeType type;
+        sf::Uint32 color;
+        int x0, y0, x1, y1;   // covered pixels, clipped to the frame
+        float p[6];           // circle: cx, cy, r; rectangle: unused; triangle: a, b, c (counter-clockwise)
+    };
+
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    TaskScheduler& scheduler;
+    vector<sf::Uint32> pixels;
+    vector<Primitive> primitives;
+    // bins[chunk * tiles + tile]: primitives of one contiguous chunk of the draw
+    // list that touch the tile. Chunks are binned in parallel and replayed in order.
+    vector<vector<unsigned>> bins;
+
+    // Pixels are kept as 32-bit words whose bytes are R, G, B, A in memory
+    // (little-endian), so the buffer doubles as an RGBA8 image.
+    static sf::Uint32 pack(sf::Color color) {
+        return static_cast<sf::Uint32>(color.r) | static_cast<sf::Uint32>(color.g) << 8 |
+               static_cast<sf::Uint32>(color.b) << 16 | static_cast<sf::Uint32>(color.a) << 24;
+    }
+
+    static sf::Color unpack(sf::Uint32 color) {
+        return sf::Color(color & 0xff, (color >> 8) & 0xff, (color >> 16) & 0xff, color >> 24);
+    }
+
+    static void blend(sf::Uint32* pixel, sf::Uint32 color) {
+        blendPixel(reinterpret_cast<sf::Uint8*>(pixel), unpack(color));
+    }
+
+#ifdef TILED_RASTERIZER_SSE2
+    // Color prepared for blending four pixels at once: the packed value for
+    // opaque fills, and per channel (source * alpha + 127) and 255 - alpha as
+    // 16-bit lanes (two pixels per register) for translucent ones.
+    struct Paint {
+        sf::Uint32 color;
+        bool opaque;
+        __m128i source;
+        __m128i inverse;
+
+        Paint(sf::Uint32 color) : color(color), opaque(color >> 24 == 255) {
+            int a = static_cast<int>(color >> 24);
+            short r = static_cast<short>((color & 0xff) * a + 127);
+            short g = static_cast<short>(((color >> 8) & 0xff) * a + 127);
+            short b = static_cast<short>(((color >> 16) & 0xff) * a + 127);
+            short alpha = static_cast<short>(255 * a + 127);
+            source = _mm_setr_epi16(r, g, b, alpha, r, g, b, alpha);
+            inverse = _mm_set1_epi16(static_cast<short>(255 - a));
+        }
+    };
+
+    // (source + pixel * inverse) / 255 on eight 16-bit channels; x / 255 is
+    // exactly (x * 0x8081) >> 23 for every 16-bit x, as in blendPixel.
+    static __m128i blend8(__m128i pixel, const Paint& paint) {
+        __m128i sum = _mm_add_epi16(paint.source, _mm_mullo_epi16(pixel, paint.inverse));
+        return _mm_srli_epi16(_mm_mulhi_epu16(sum, _mm_set1_epi16(static_cast<short>(0x8081))), 7);
+    }
+
+    // Writes the paint into the lanes of pixel[0..3] selected by mask.
+    static void fill4(sf::Uint32* pixel, __m128 mask, const Paint& paint) {
+        __m128i select = _mm_castps_si128(mask);
+        __m128i old = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixel));
+        __m128i value;
+        if (paint.opaque) {
+            value = _mm_set1_epi32(static_cast<int>(paint.color));
+        }
+        else {
+            __m128i zero = _mm_setzero_si128();
+            __m128i low = blend8(_mm_unpacklo_epi8(old, zero), paint);
+            __m128i high = blend8(_mm_unpackhi_epi8(old, zero), paint);
+            value = _mm_packus_epi16(low, high);
+        }
+        value = _mm_or_si128(_mm_and_si128(select, value), _mm_andnot_si128(select, old));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pixel), value);
+    }
+
+    // Runs coverage(px, py) over the clipped box four pixels at a time; px holds
+    // the pixel centers of four neighbouring columns. Lanes past x1 are masked off.
+    template <typename Coverage>
+    void fillBox(int x0, int y0, int x1, int y1, sf::Uint32 color, Coverage coverage) {
+        const __m128 laneOffsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        const __m128 lastColumn = _mm_set1_ps(static_cast<float>(x1) + 0.5f);
+        Paint paint(color);
+        for (int y = y0; y <= y1; y++) {
+            float py = y + 0.5f;
+            sf::Uint32* row = &pixels[static_cast<size_t>(y) * width];
+            for (int x = x0; x <= x1; x += 4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneOffsets);
+                __m128 mask = _mm_and_ps(coverage(px, py), _mm_cmple_ps(px, lastColumn));
+                if (_mm_movemask_ps(mask) == 0)
+                    continue;
+                if (x + 3 < width) {
+                    fill4(row + x, mask, paint);
+                }
+                else {
+                    // Last columns of the frame: no room for a 16-byte access.
+                    int bits = _mm_movemask_ps(mask);
+                    for (int lane = 0; lane < 4 && x + lane < width; lane++)
+                        if (bits & (1 << lane))
+                            blend(row + x + lane, color);
+                }
+            }
+        }
+    }
+
+    void rasterize(const Primitive& shape, int x0, int y0, int x1, int y1) {
+        switch (shape.type) {
+        case ShapeType::Circle: {
+            __m128 cx = _mm_set1_ps(shape.p[0]);
+            __m128 r2 = _mm_set1_ps(shape.p[2] * shape.p[2]);
+            float cy = shape.p[1];
+            fillBox(x0, y0, x1, y1, shape.color, [&](__m128 px, float py) {
+                __m128 dx = _mm_sub_ps(px, cx);
+                __m128 dy = _mm_set1_ps(py - cy);
+                return _mm_cmple_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), r2);
+            });
+            break;
+        }
+        case ShapeType::Rectangle: {
+            __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            fillBox(x0, y0, x1, y1, shape.color, [&](__m128, float) {
+                return all;
+            });
+            break;
+        }
+        case ShapeType::Triangle: {
+            // e = (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x) per edge,
+            // the same expression the scalar rasterizer evaluates.
+            const float* p = shape.p;
+            __m128 ex[3], ey[3], ox[3];
+            float oy[3];
+            for (int k = 0; k < 3; k++) {
+                int from = k * 2;
+                int to = ((k + 1) % 3) * 2;
+                ex[k] = _mm_set1_ps(p[to] - p[from]);
+                ey[k] = _mm_set1_ps(p[to + 1] - p[from + 1]);
+                ox[k] = _mm_set1_ps(p[from]);
+                oy[k] = p[from + 1];
+            }
+            __m128 zero = _mm_setzero_ps();
+            fillBox(x0, y0, x1, y1, shape.color, [&](__m128 px, float py) {
+                __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                for (int k = 0; k < 3; k++) {
+                    __m128 e = _mm_sub_ps(_mm_mul_ps(ex[k], _mm_set1_ps(py - oy[k])), _mm_mul_ps(ey[k], _mm_sub_ps(px, ox[k])));
+                    mask = _mm_and_ps(mask, _mm_cmpge_ps(e, zero));
+                }
+                return mask;
+            });
+            break;
+        }
+        }
+    }
+#else
+    template <typename Coverage>
+    void fillBox(int x0, int y0, int x1, int y1, sf::Uint32 color, Coverage coverage) {
+        for (int y = y0; y <= y1; y++) {
+            float py = y + 0.5f;
+            sf::Uint32* row = &pixels[static_cast<size_t>(y) * width];
+            for (int x = x0; x <= x1; x++)
+                if (coverage(x + 0.5f, py)) {
+                    if (color >> 24 == 255)
+                        row[x] = color;
+                    else
+                        blend(row + x, color);
+                }
+        }
+    }
+
+    void rasterize(const Primitive& shape, int x0, int y0, int x1, int y1) {
+        const float* p = shape.p;
+        switch (shape.type) {
+        case ShapeType::Circle:
+            fillBox(x0, y0, x1, y1, shape.color, [&](float px, float py) {
+                float dx = px - p[0];
+                float dy = py - p[1];
+                return dx * dx + dy * dy <= p[2] * p[2];
+            });
+            break;
+        case ShapeType::Rectangle:
+            fillBox(x0, y0, x1, y1, shape.color, [](float, float) {
+                return true;
+            });
+            break;
+        case ShapeType::Triangle:
+            fillBox(x0, y0, x1, y1, shape.color, [&](float px, float py) {
+                for (int k = 0; k < 3; k++) {
+                    int from = k * 2;
+                    int to = ((k + 1) % 3) * 2;
+                    if ((p[to] - p[from]) * (py - p[from + 1]) - (p[to + 1] - p[from + 1]) * (px - p[from]) < 0.f)
+                        return false;
+                }
+                return true;
+            });
+            break;
+        }
+    }
+#endif
+
+    // Bins primitives [first, last) into the tile lists of one chunk.
+    void binChunk(unsigned chunk, size_t first, size_t last) {
+        size_t tiles = static_cast<size_t>(tilesX) * tilesY;
+        vector<unsigned>* chunkBins = &bins[chunk * tiles];
+        for (size_t i = first; i < last; i++) {
+            const Primitive& shape = primitives[i];
+            for (int ty = shape.y0 / tileSize; ty <= shape.y1 / tileSize; ty++)
+                for (int tx = shape.x0 / tileSize; tx <= shape.x1 / tileSize; tx++)
+                    chunkBins[ty * tilesX + tx].push_back(static_cast<unsigned>(i));
+        }
+    }
+
+    void renderTile(int tile, unsigned chunks) {
+        size_t tiles = static_cast<size_t>(tilesX) * tilesY;
+        int tx0 = (tile % tilesX) * tileSize;
+        int ty0 = (tile / tilesX) * tileSize;
+        int tx1 = min(tx0 + tileSize, width) - 1;
+        int ty1 = min(ty0 + tileSize, height) - 1;
+        for (unsigned chunk = 0; chunk < chunks; chunk++) {
+            for (unsigned i : bins[chunk * tiles + tile]) {
+                const Primitive& shape = primitives[i];
+                rasterize(shape, max(shape.x0, tx0), max(shape.y0, ty0), min(shape.x1, tx1), min(shape.y1, ty1));
+            }
+        }
+    }
+
+public:
+    TiledRasterizer(unsigned width, unsigned height, TaskScheduler& scheduler = TaskScheduler::shared())
+        : width(static_cast<int>(width)), height(static_cast<int>(height)),
+          tilesX((static_cast<int>(width) + tileSize - 1) / tileSize),
+          tilesY((static_cast<int>(height) + tileSize - 1) / tileSize),
+          scheduler(scheduler), pixels(static_cast<size_t>(width) * height, 0) {}
+
+    void clear(sf::Color color) override {
+        primitives.clear();
+        fill(pixels.begin(), pixels.end(), pack(color));
+    }
+
+    void drawShape(const ShapeStore& store, unsigned index) override {
+        sf::Color color = store.getFillColor(index);
+        if (color.a == 0)
+            return;
+        ShapeGeometry geometry = store.getGeometry(index);
+        Primitive shape = {};
+        shape.type = geometry.type;
+        shape.color = pack(color);
+        switch (shape.type) {
+        case ShapeType::Circle: {
+            float radius = geometry.width;
+            shape.p[0] = geometry.x + radius;
+            shape.p[1] = geometry.y + radius;
+            shape.p[2] = radius;
+            shape.x0 = static_cast<int>(floor(shape.p[0] - radius));
+            shape.x1 = static_cast<int>(ceil(shape.p[0] + radius));
+            shape.y0 = static_cast<int>(floor(shape.p[1] - radius));
+            shape.y1 = static_cast<int>(ceil(shape.p[1] + radius));
+            break;
+        }
+        case ShapeType::Rectangle: {
+            sf::FloatRect rect = ShapeStore::getBounds(geometry);
+            shape.x0 = static_cast<int>(ceil(rect.left - 0.5f));
+            shape.x1 = static_cast<int>(ceil(rect.left + rect.width - 0.5f)) - 1;
+            shape.y0 = static_cast<int>(ceil(rect.top - 0.5f));
+            shape.y1 = static_cast<int>(ceil(rect.top + rect.height - 0.5f)) - 1;
+            break;
+        }
+        case ShapeType::Triangle: {
+            const sf::Vector2f* p = geometry.points;
+            sf::Vector2f origin(geometry.x, geometry.y);
+            sf::Vector2f a = origin + p[0], b = origin + p[1], c = origin + p[2];
+            float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+            if (area == 0.f)
+                return;
+            if (area < 0.f)
+                swap(b, c);
+            float corners[6] = { a.x, a.y, b.x, b.y, c.x, c.y };
+            copy(corners, corners + 6, shape.p);
+            shape.x0 = static_cast<int>(floor(min(a.x, min(b.x, c.x))));
+            shape.x1 = static_cast<int>(ceil(max(a.x, max(b.x, c.x))));
+            shape.y0 = static_cast<int>(floor(min(a.y, min(b.y, c.y))));
+            shape.y1 = static_cast<int>(ceil(max(a.y, max(b.y, c.y))));
+            break;
+        }
+        }
+        shape.x0 = max(shape.x0, 0);
+        shape.y0 = max(shape.y0, 0);
+        shape.x1 = min(shape.x1, width - 1);
+        shape.y1 = min(shape.y1, height - 1);
+        if (shape.x0 > shape.x1 || shape.y0 > shape.y1)
+            return;
+        primitives.push_back(shape);
+    }
+
+    void drawShapes(const ShapeStore& store, const vector<ShapeHandle>& handles) override {
+        primitives.reserve(primitives.size() + handles.size());
+        RenderBackend::drawShapes(store, handles);
+    }
+
+    // Rasterizes everything drawn since clear().
+    void display() override {
+        size_t tiles = static_cast<size_t>(tilesX) * tilesY;
+        // Small frames are binned in one chunk, on the calling thread.
+        unsigned chunks = primitives.size() < 4096 ? 1u : scheduler.getThreadCount();
+        bins.resize(chunks * tiles);
+        for (auto& bin : bins)
+            bin.clear();
+
+        scheduler.parallelFor(0, chunks, 1, [&](size_t firstChunk, size_t lastChunk) {
+            for (size_t chunk = firstChunk; chunk < lastChunk; chunk++) {
+                size_t first = primitives.size() * chunk / chunks;
+                size_t last = primitives.size() * (chunk + 1) / chunks;
+                binChunk(static_cast<unsigned>(chunk), first, last);
+            }
+        });
+
+        scheduler.parallelFor(0, tiles, 1, [&](size_t firstTile, size_t lastTile) {
+            for (size_t tile = firstTile; tile < lastTile; tile++)
+                renderTile(static_cast<int>(tile), chunks);
+        });
+        primitives.clear();
+    }
+
+    unsigned getWidth() const {
+        return static_cast<unsigned>(width);
+    }
+
+    unsigned getHeight() const {
+        return static_cast<unsigned>(height);
+    }
+
+    unsigned getThreadCount() const {
+        return scheduler.getThreadCount();
+    }
+
+    // RGBA8 bytes, row by row.
+    const sf::Uint8* getPixels() const {
+        return reinterpret_cast<const sf::Uint8*>(pixels.data());
+    }
+
+    bool save(const string& filename) const {
+        return saveImage(filename, getWidth(), getHeight(), getPixels());
+    }
+};
@@ -0,0 +1,296 @@
+﻿#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <deque>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "GraphicObject.h"
+#include "Scene.h"
+#include "SceneJournal.h"
+
+using namespace std;
+
+// Undo and redo for the edits made from the main window. Every edit goes
+// through the history, which applies it and records a command. Commands name
+// top-level objects by their position in Scene::objects; that stays valid
+// because the history is linear: objects are only appended (create) and only
+// the last one is ever removed (undoing its creation).
+//
+// A command keeps just enough to go both ways:
+//   create      the object type, to make it again on redo;
+//   move/resize the object's placement before and after; consecutive moves
+//               of one object are merged into one command;
+//   color/vis.  the previous colors of the object's leaves, run-length
+//               encoded in draw order, which is a few runs even for an
+//               Aggregate of a million shapes;
+//   load        the replaced Scene itself, which is kept rather than copied.
+// So undo and redo are O(1) except for colors, which are one pass over the
+// object's leaves. Old commands are dropped once the history goes over its
+// memory budget.
+class UndoHistory {
+public:
+    // What an undo or redo did, so the caller knows which caches to drop.
+    enum class Effect {
+        None,
+        Changed,
+        SceneReplaced
+    };
+
+private:
+    enum class Kind {
+        Create,
+        Move,
+        Resize,
+        Recolor,
+        Visibility,
+        Load
+    };
+
+    struct Command {
+        Kind kind;
+        size_t object = 0;
+        BinaryNodeType node = BinaryAggregate;
+        ObjectPlacement before;
+        ObjectPlacement after;
+        sf::Color color;
+        bool visible = true;
+        vector<ColorRun> runs;
+        unique_ptr<Scene> scene;
+    };
+
+    // A rough per-shape cost of a Scene kept for undoing a load.
+    static const size_t sceneBytesPerShape = 128;
+
+    deque<Command> done;
+    vector<Command> undone;
+    size_t bytes;
+    size_t budget;
+    SceneJournal* journal;
+
+    static size_t sizeOf(const Command& command) {
+        return sizeof(Command) + command.runs.capacity() * sizeof(ColorRun) +
+            (command.scene ? command.scene->store.size() * sceneBytesPerShape : 0);
+    }
+
+    void push(Command command) {
+        for (auto& dropped : undone)
+            bytes -= sizeOf(dropped);
+        undone.clear();
+        bytes += sizeOf(command);
+        done.push_back(std::move(command));
+        // The newest command always stays, whatever its size.
+        while (bytes > budget && done.size() > 1) {
+            bytes -= sizeOf(done.front());
+            done.pop_front();
+        }
+    }
+
+public:
+    UndoHistory(size_t budget = 256 << 20) : bytes(0), budget(budget), journal(nullptr) {}
+
+    // Every edit, undo and redo is also written to the journal, if set.
+    void setJournal(SceneJournal* target) {
+        journal = target;
+    }
+
+    SceneJournal* getJournal() const {
+        return journal;
+    }
+
+    bool canUndo() const {
+        return !done.empty();
+    }
+
+    bool canRedo() const {
+        return !undone.empty();
+    }
+
+    void clear() {
+        done.clear();
+        undone.clear();
+        bytes = 0;
+    }
+
+    // Edits. Each applies the change to the scene and records it.
+
+    template <typename T>
+    size_t create(Scene& scene) {
+        Command command;
+        command.kind = Kind::Create;
+        if constexpr (is_same<T, Aggregate>::value)
+            command.node = BinaryAggregate;
+        else
+            command.node = ShapeFormat<T>::Record::node;
+        command.object = scene.objects.size();
+        scene.objects.push_back(scene.createNode(command.node));
+        if (journal)
+            journal->created(command.node);
+        push(std::move(command));
+        return scene.objects.size() - 1;
+    }
+
+    void move(Scene& scene, size_t object, float dx, float dy) {
+        GraphicObject* target = scene.objects[object];
+        if (!done.empty() && done.back().kind == Kind::Move && done.back().object == object && undone.empty()) {
+            target->move(dx, dy);
+            done.back().after = target->getPlacement();
+            if (journal)
+                journal->placed(object, done.back().after);
+            return;
+        }
+        Command command;
+        command.kind = Kind::Move;
+        command.object = object;
+        command.before = target->getPlacement();
+        target->move(dx, dy);
+        command.after = target->getPlacement();
+        if (journal)
+            journal->placed(object, command.after);
+        push(std::move(command));
+    }
+
+    void resize(Scene& scene, size_t object, float size) {
+        GraphicObject* target = scene.objects[object];
+        Command command;
+        command.kind = Kind::Resize;
+        command.object = object;
+        command.before = target->getPlacement();
+        target->changeSize(size);
+        command.after = target->getPlacement();
+        if (journal)
+            journal->placed(object, command.after);
+        push(std::move(command));
+    }
+
+    void recolor(Scene& scene, size_t object, sf::Color color) {
+        GraphicObject* target = scene.objects[object];
+        Command command;
+        command.kind = Kind::Recolor;
+        command.object = object;
+        command.color = color;
+        scene.captureColors(target, command.runs);
+        target->changeColor(color);
+        if (journal)
+            journal->recolored(object, color);
+        push(std::move(command));
+    }
+
+    void setVisible(Scene& scene, size_t object, bool visible) {
+        GraphicObject* target = scene.objects[object];
+        Command command;
+        command.kind = Kind::Visibility;
+        command.object = object;
+        command.visible = target->isVisible();
+        scene.captureColors(target, command.runs);
+        target->setVisible(visible);
+        if (journal)
+            journal->visibilityChanged(object, visible);
+        push(std::move(command));
+    }
+
+    // Swaps in a loaded scene, keeping the old one for undo.
+    void replaceScene(unique_ptr<Scene>& scene, unique_ptr<Scene> loaded) {
+        Command command;
+        command.kind = Kind::Load;
+        command.scene = std::move(scene);
+        scene = std::move(loaded);
+        if (journal)
+            journal->checkpoint(*scene, true);
+        push(std::move(command));
+    }
+
+    Effect undo(unique_ptr<Scene>& scene) {
+        if (done.empty())
+            return Effect::None;
+        Command command = std::move(done.back());
+        done.pop_back();
+        bytes -= sizeOf(command);
+        Effect effect = Effect::Changed;
+        switch (command.kind) {
+        case Kind::Create:
+            scene->destroy(scene->objects[command.object]);
+            if (journal)
+                journal->removed(command.object);
+            break;
+        case Kind::Move:
+        case Kind::Resize:
+            scene->objects[command.object]->setPlacement(command.before);
+            if (journal)
+                journal->placed(command.object, command.before);
+            break;
+        case Kind::Recolor: {
+            GraphicObject* target = scene->objects[command.object];
+            scene->restoreColors(target, command.runs);
+            if (journal)
+                journal->colorsRestored(command.object, target->isVisible(), command.runs);
+            break;
+        }
+        case Kind::Visibility: {
+            GraphicObject* target = scene->objects[command.object];
+            // Both ways round: the object's own flag, then the leaves as they were.
+            bool visible = target->isVisible();
+            target->setVisible(command.visible);
+            scene->restoreColors(target, command.runs);
+            if (journal)
+                journal->colorsRestored(command.object, command.visible, command.runs);
+            command.visible = visible;
+            break;
+        }
+        case Kind::Load:
+            swap(scene, command.scene);
+            if (journal)
+                journal->checkpoint(*scene, true);
+            effect = Effect::SceneReplaced;
+            break;
+        }
+        bytes += sizeOf(command);
+        undone.push_back(std::move(command));
+        return effect;
+    }
+
+    Effect redo(unique_ptr<Scene>& scene) {
+        if (undone.empty())
+            return Effect::None;
+        Command command = std::move(undone.back());
+        undone.pop_back();
+        bytes -= sizeOf(command);
+        Effect effect = Effect::Changed;
+        switch (command.kind) {
+        case Kind::Create:
+            scene->objects.push_back(scene->createNode(command.node));
+            if (journal)
+                journal->created(command.node);
+            break;
+        case Kind::Move:
+        case Kind::Resize:
+            scene->objects[command.object]->setPlacement(command.after);
+            if (journal)
+                journal->placed(command.object, command.after);
+            break;
+        case Kind::Recolor:
+            scene->objects[command.object]->changeColor(command.color);
+            if (journal)
+                journal->recolored(command.object, command.color);
+            break;
+        case Kind::Visibility: {
+            GraphicObject* target = scene->objects[command.object];
+            bool visible = target->isVisible();
+            target->setVisible(command.visible);
+            if (journal)
+                journal->visibilityChanged(command.object, command.visible);
+            command.visible = visible;
+            break;
+        }
+        case Kind::Load:
+            swap(scene, command.scene);
+            if (journal)
+                journal->checkpoint(*scene, true);
+            effect = Effect::SceneReplaced;
+            break;
+        }
+        bytes += sizeOf(command);
+        done.push_back(std::move(command));
+        return effect;
+    }
+};